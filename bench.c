@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "cap.h"
+
+// Storage server request, same layout as in ss.c and client.c
+typedef struct {
+    char operation[32];
+    char src_path[256];
+    char dest_path[256];
+    char data[1024];
+    Capability cap;
+} Request;
+
+// WRITE flag, as in ss_function.h: WRITE_SYNC, and durability + 1 from bit WRITE_DURABILITY_SHIFT up
+#define WRITE_SYNC 1
+#define WRITE_DURABILITY_SHIFT 4
+
+typedef struct {
+    const char *ip;
+    int port;
+    const char *path;
+    int rounds;
+    long long bytes;  // Received by this client
+    int failures;
+} StreamClient;
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU seconds (user + system) used so far by a process, -1 if it cannot be read
+static double processCpuSeconds(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    unsigned long utime = 0, stime = 0;
+    int fields = fscanf(file, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    fclose(file);
+    return fields == 2 ? (double)(utime + stime) / sysconf(_SC_CLK_TCK) : -1;
+}
+
+// Connected socket to the storage server, -1 on failure
+static int connectServer(const char *ip, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+    return sock;
+}
+
+// One STREAM: status code, then data until the storage server closes the connection
+static long long streamOnce(StreamClient *client, char *buffer, size_t size) {
+    int sock = connectServer(client->ip, client->port);
+    if (sock < 0) {
+        return -1;
+    }
+
+    Request request;
+    memset(&request, 0, sizeof(request));
+    strcpy(request.operation, "STREAM");
+    snprintf(request.src_path, sizeof(request.src_path), "%s", client->path);
+    if (getenv("CAP_KEY") != NULL) {
+        capSign(&request.cap, getenv("CAP_KEY"), request.src_path, CAP_READ, (long long)time(NULL) + DEFAULT_CAP_TTL, NULL);
+    }
+
+    int status = -1;
+    long long total = 0;
+    if (send(sock, &request, sizeof(request), 0) == sizeof(request) &&
+        recv(sock, &status, sizeof(status), MSG_WAITALL) == sizeof(status) && status == 0) {
+        ssize_t n;
+        while ((n = recv(sock, buffer, size, 0)) > 0) {
+            total += n;
+        }
+    }
+    close(sock);
+    return status == 0 ? total : -1;
+}
+
+static void *streamClient(void *arg) {
+    StreamClient *client = (StreamClient *)arg;
+    size_t size = 256 * 1024;
+    char *buffer = malloc(size);
+    for (int i = 0; buffer != NULL && i < client->rounds; i++) {
+        long long bytes = streamOnce(client, buffer, size);
+        if (bytes < 0) {
+            client->failures++;
+        } else {
+            client->bytes += bytes;
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Many concurrent STREAM clients against one storage server: aggregate throughput and, given its pid, the
+// storage server's CPU time per GB served
+static int benchStream(int argc, char *argv[]) {
+    if (argc < 6) {
+        fprintf(stderr, "Usage: %s stream <ss ip> <ss client port> <path> <clients> [rounds] [ss pid]\n", argv[0]);
+        return 1;
+    }
+    int clients = atoi(argv[5]);
+    int rounds = argc > 6 ? atoi(argv[6]) : 1;
+    int ss_pid = argc > 7 ? atoi(argv[7]) : 0;
+    if (clients < 1 || rounds < 1) {
+        fprintf(stderr, "clients and rounds must be positive\n");
+        return 1;
+    }
+
+    StreamClient *state = calloc(clients, sizeof(StreamClient));
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    if (state == NULL || threads == NULL) {
+        perror("Benchmark allocation failed");
+        return 1;
+    }
+
+    double cpu_start = ss_pid > 0 ? processCpuSeconds(ss_pid) : -1;
+    double start = nowSeconds();
+    for (int i = 0; i < clients; i++) {
+        state[i].ip = argv[2];
+        state[i].port = atoi(argv[3]);
+        state[i].path = argv[4];
+        state[i].rounds = rounds;
+        pthread_create(&threads[i], NULL, streamClient, &state[i]);
+    }
+    long long bytes = 0;
+    int failures = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        bytes += state[i].bytes;
+        failures += state[i].failures;
+    }
+    double elapsed = nowSeconds() - start;
+    double cpu_end = ss_pid > 0 ? processCpuSeconds(ss_pid) : -1;
+
+    printf("stream: %d clients x %d rounds, %lld bytes in %.3fs, %.1f MB/s, %d failed\n",
+           clients, rounds, bytes, elapsed, bytes / elapsed / (1024 * 1024), failures);
+    if (cpu_start >= 0 && cpu_end >= 0 && bytes > 0) {
+        printf("storage server cpu: %.3fs, %.3fs per GB\n", cpu_end - cpu_start,
+               (cpu_end - cpu_start) / (bytes / (1024.0 * 1024 * 1024)));
+    }
+    free(state);
+    free(threads);
+    return failures == 0 ? 0 : 1;
+}
+
+// One READ of the whole file: length header, the bytes, then a status code
+static long long readOnce(StreamClient *client, char *buffer, size_t size) {
+    int sock = connectServer(client->ip, client->port);
+    if (sock < 0) {
+        return -1;
+    }
+
+    Request request;
+    memset(&request, 0, sizeof(request));
+    strcpy(request.operation, "READ");
+    snprintf(request.src_path, sizeof(request.src_path), "%s", client->path);
+    if (getenv("CAP_KEY") != NULL) {
+        capSign(&request.cap, getenv("CAP_KEY"), request.src_path, CAP_READ, (long long)time(NULL) + DEFAULT_CAP_TTL, NULL);
+    }
+
+    long long length = -1, total = 0;
+    int status = -1;
+    if (send(sock, &request, sizeof(request), 0) == sizeof(request) &&
+        recv(sock, &length, sizeof(length), MSG_WAITALL) == sizeof(length) && length >= 0) {
+        while (total < length) {
+            ssize_t n = recv(sock, buffer, length - total < (long long)size ? (size_t)(length - total) : size, 0);
+            if (n <= 0) {
+                break;
+            }
+            total += n;
+        }
+        if (total == length && recv(sock, &status, sizeof(status), MSG_WAITALL) != sizeof(status)) {
+            status = -1;
+        }
+    }
+    close(sock);
+    return status == 0 ? total : -1;
+}
+
+static void *readClient(void *arg) {
+    StreamClient *client = (StreamClient *)arg;
+    size_t size = 64 * 1024;
+    char *buffer = malloc(size);
+    for (int i = 0; buffer != NULL && i < client->rounds; i++) {
+        long long bytes = readOnce(client, buffer, size);
+        if (bytes < 0) {
+            client->failures++;
+        } else {
+            client->bytes += bytes;
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Many concurrent READs of one (small, hot) file: reads per second, then the storage server's cache counters
+static int benchRead(int argc, char *argv[]) {
+    if (argc < 6) {
+        fprintf(stderr, "Usage: %s read <ss ip> <ss client port> <path> <clients> [rounds] [ss naming port]\n", argv[0]);
+        return 1;
+    }
+    int clients = atoi(argv[5]);
+    int rounds = argc > 6 ? atoi(argv[6]) : 1000;
+    if (clients < 1 || rounds < 1) {
+        fprintf(stderr, "clients and rounds must be positive\n");
+        return 1;
+    }
+
+    StreamClient *state = calloc(clients, sizeof(StreamClient));
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    if (state == NULL || threads == NULL) {
+        perror("Benchmark allocation failed");
+        return 1;
+    }
+
+    double start = nowSeconds();
+    for (int i = 0; i < clients; i++) {
+        state[i].ip = argv[2];
+        state[i].port = atoi(argv[3]);
+        state[i].path = argv[4];
+        state[i].rounds = rounds;
+        pthread_create(&threads[i], NULL, readClient, &state[i]);
+    }
+    long long bytes = 0;
+    int failures = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        bytes += state[i].bytes;
+        failures += state[i].failures;
+    }
+    double elapsed = nowSeconds() - start;
+    long long reads = (long long)clients * rounds - failures;
+    printf("read: %d clients x %d rounds, %lld bytes in %.3fs, %.0f reads/s, %d failed\n",
+           clients, rounds, bytes, elapsed, reads / elapsed, failures);
+
+    // STATS is not a client operation, the storage server answers it on its naming port
+    int sock = argc > 7 ? connectServer(argv[2], atoi(argv[7])) : -1;
+    if (sock >= 0) {
+        Request request;
+        memset(&request, 0, sizeof(request));
+        strcpy(request.operation, "STATS");
+        char stats[512];
+        ssize_t n = -1;
+        if (send(sock, &request, sizeof(request), 0) == sizeof(request)) {
+            n = recv(sock, stats, sizeof(stats) - 1, 0);
+        }
+        if (n > 0) {
+            stats[n] = '\0';
+            printf("%s\n", stats);
+        }
+        close(sock);
+    }
+    free(state);
+    free(threads);
+    return failures == 0 ? 0 : 1;
+}
+
+typedef struct {
+    const char *ip;
+    int port;
+    char path[256];
+    int writes;
+    int size;
+    int flag;       // WRITE flag: WRITE_SYNC and durability
+    int done;
+    int failures;
+} WriteClient;
+
+// One WRITE: the request, the sync flag, then the storage server's acknowledgment
+static int writeOnce(WriteClient *client) {
+    int sock = connectServer(client->ip, client->port);
+    if (sock < 0) {
+        return -1;
+    }
+
+    Request request;
+    memset(&request, 0, sizeof(request));
+    strcpy(request.operation, "WRITE");
+    snprintf(request.src_path, sizeof(request.src_path), "%s", client->path);
+    memset(request.data, 'w', client->size - 1);
+    request.data[client->size - 1] = '\n';
+    if (getenv("CAP_KEY") != NULL) {
+        capSign(&request.cap, getenv("CAP_KEY"), request.src_path, CAP_WRITE, (long long)time(NULL) + DEFAULT_CAP_TTL, NULL);
+    }
+
+    char ack[256];
+    ssize_t n = -1;
+    if (send(sock, &request, sizeof(request), 0) == sizeof(request) &&
+        send(sock, &client->flag, sizeof(client->flag), 0) == sizeof(client->flag)) {
+        n = recv(sock, ack, sizeof(ack) - 1, 0);
+    }
+    close(sock);
+    if (n <= 0) {
+        return -1;
+    }
+    ack[n] = '\0';
+    return strstr(ack, "successfully") != NULL || strstr(ack, "Asynchronously") != NULL ? 0 : -1;
+}
+
+static void *writeClient(void *arg) {
+    WriteClient *client = (WriteClient *)arg;
+    for (int i = 0; i < client->writes; i++) {
+        if (writeOnce(client) == 0) {
+            client->done++;
+        } else {
+            client->failures++;
+        }
+    }
+    return NULL;
+}
+
+// N clients appending to N files on one storage server, each in a loop: writes per second and bytes per second.
+// durability is none, group or dsync; without it the storage server's SS_DURABILITY applies
+static int benchWrite(int argc, char *argv[]) {
+    if (argc < 6) {
+        fprintf(stderr, "Usage: %s write <ss ip> <ss client port> <dir> <clients> [writes] [bytes] [sync] [durability]\n", argv[0]);
+        return 1;
+    }
+    int clients = atoi(argv[5]);
+    int writes = argc > 6 ? atoi(argv[6]) : 1000;
+    int size = argc > 7 ? atoi(argv[7]) : 128;
+    int sync = argc > 8 ? atoi(argv[8]) : 1;
+    const char *levels[] = {"none", "group", "dsync"};
+    int level = -1;
+    for (int i = 0; argc > 9 && i < 3; i++) {
+        if (strcmp(argv[9], levels[i]) == 0) {
+            level = i;
+        }
+    }
+    if (clients < 1 || writes < 1 || size < 1 || size > 1023 || (argc > 9 && level < 0)) {
+        fprintf(stderr, "clients and writes must be positive, bytes between 1 and 1023, durability none, group or dsync\n");
+        return 1;
+    }
+    int flag = (sync ? WRITE_SYNC : 0) | (level + 1) << WRITE_DURABILITY_SHIFT;
+
+    WriteClient *state = calloc(clients, sizeof(WriteClient));
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    if (state == NULL || threads == NULL) {
+        perror("Benchmark allocation failed");
+        return 1;
+    }
+
+    double start = nowSeconds();
+    for (int i = 0; i < clients; i++) {
+        state[i].ip = argv[2];
+        state[i].port = atoi(argv[3]);
+        snprintf(state[i].path, sizeof(state[i].path), "%s/bench-%d", argv[4], i);
+        state[i].writes = writes;
+        state[i].size = size;
+        state[i].flag = flag;
+        pthread_create(&threads[i], NULL, writeClient, &state[i]);
+    }
+    long long done = 0;
+    int failures = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        done += state[i].done;
+        failures += state[i].failures;
+    }
+    double elapsed = nowSeconds() - start;
+
+    printf("write: %d clients x %d %s writes of %d bytes, durability %s, in %.3fs, %.0f writes/s, %.2f MB/s, %d failed\n",
+           clients, writes, sync ? "sync" : "async", size, level < 0 ? "default" : levels[level], elapsed, done / elapsed,
+           done * size / elapsed / (1024 * 1024), failures);
+    free(state);
+    free(threads);
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "stream") == 0) {
+        return benchStream(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "write") == 0) {
+        return benchWrite(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "read") == 0) {
+        return benchRead(argc, argv);
+    }
+    fprintf(stderr, "Usage: %s stream|write|read ...\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,310 @@
+#include "blockcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Function to create a cache of capacity bytes holding files of at most max_file bytes; NULL if capacity is 0
+BlockCache* createBlockCache(size_t capacity, size_t max_file) {
+    if (capacity == 0) {
+        return NULL;
+    }
+    BlockCache *cache = (BlockCache*)calloc(1, sizeof(BlockCache));
+    if (!cache) {
+        perror("Block cache allocation failed");
+        return NULL;
+    }
+    cache->max_file = max_file;
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        BlockShard *shard = &cache->shards[i];
+        shard->capacity = capacity / BLOCK_CACHE_SHARDS;
+        shard->bucket_count = 1024;
+        shard->buckets = (CachedBlock**)calloc(shard->bucket_count, sizeof(CachedBlock*));
+        if (!shard->buckets) {
+            perror("Block cache allocation failed");
+            for (int j = 0; j < i; j++) {
+                free(cache->shards[j].buckets);
+            }
+            free(cache);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    return cache;
+}
+
+// Collapse repeated slashes and drop a trailing one, as the descriptor cache does
+static void normalizePath(const char *path, char *out, size_t size) {
+    size_t n = 0;
+    for (const char *p = path; *p && n + 1 < size; p++) {
+        if (*p != '/' || n == 0 || out[n - 1] != '/') {
+            out[n++] = *p;
+        }
+    }
+    if (n > 1 && out[n - 1] == '/') {
+        n--;
+    }
+    out[n] = '\0';
+}
+
+static unsigned int pathHash(const char *path) {
+    unsigned int hash = 5381;
+    for (const unsigned char *p = (const unsigned char*)path; *p; p++) {
+        hash = hash * 33 + *p;
+    }
+    return hash;
+}
+
+static BlockShard* shardOf(BlockCache *cache, unsigned int hash) {
+    return &cache->shards[hash % BLOCK_CACHE_SHARDS];
+}
+
+static CachedBlock* findBlock(BlockShard *shard, const char *path, unsigned int hash) {
+    for (CachedBlock *block = shard->buckets[(hash / BLOCK_CACHE_SHARDS) % shard->bucket_count]; block; block = block->bucket_next) {
+        if (strcmp(block->path, path) == 0) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static void freeBlock(CachedBlock *block) {
+    free(block->path);
+    free(block->data);
+    free(block);
+}
+
+// Take block out of its shard; called with the lock held. Returns 1 if no reader holds it and the caller
+// must free it after unlocking
+static int unlinkBlock(BlockShard *shard, CachedBlock *block) {
+    unsigned int hash = pathHash(block->path);
+    CachedBlock **link = &shard->buckets[(hash / BLOCK_CACHE_SHARDS) % shard->bucket_count];
+    while (*link != block) {
+        link = &(*link)->bucket_next;
+    }
+    *link = block->bucket_next;
+    if (block->newer) {
+        block->newer->older = block->older;
+    } else {
+        shard->newest = block->older;
+    }
+    if (block->older) {
+        block->older->newer = block->newer;
+    } else {
+        shard->oldest = block->newer;
+    }
+    shard->bytes -= block->size;
+    return --block->refs == 0;
+}
+
+static void makeNewest(BlockShard *shard, CachedBlock *block) {
+    block->newer = NULL;
+    block->older = shard->newest;
+    if (shard->newest) {
+        shard->newest->newer = block;
+    } else {
+        shard->oldest = block;
+    }
+    shard->newest = block;
+}
+
+// Function to look path up. A hit returns the block with a reference the caller gives back with
+// blockCacheRelease. A miss returns NULL and the generation to hand to blockCachePut with what was read
+CachedBlock* blockCacheGet(BlockCache *cache, const char *path, unsigned long *generation) {
+    if (!cache) {
+        return NULL;
+    }
+    char key[4096];
+    normalizePath(path, key, sizeof(key));
+    unsigned int hash = pathHash(key);
+    BlockShard *shard = shardOf(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    CachedBlock *block = findBlock(shard, key, hash);
+    if (block) {
+        block->refs++;
+        shard->hits++;
+        if (shard->newest != block) {
+            block->newer->older = block->older;
+            if (block->older) {
+                block->older->newer = block->newer;
+            } else {
+                shard->oldest = block->newer;
+            }
+            makeNewest(shard, block);
+        }
+    } else {
+        shard->misses++;
+        *generation = shard->generation;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return block;
+}
+
+// Function to decide whether a missed file is worth reading into the cache: small enough, and missed recently
+// already. Returns 1 if the caller should read it and call blockCachePut
+int blockCacheAdmit(BlockCache *cache, const char *path, size_t size) {
+    if (!cache || size > cache->max_file) {
+        return 0;
+    }
+    char key[4096];
+    normalizePath(path, key, sizeof(key));
+    unsigned int hash = pathHash(key);
+    BlockShard *shard = shardOf(cache, hash);
+    unsigned int slot = (hash / BLOCK_CACHE_SHARDS) % BLOCK_CACHE_DOORKEEPER;
+    int admit;
+
+    pthread_mutex_lock(&shard->lock);
+    // A zero hash cannot be told from an empty slot, such paths are admitted straight away
+    admit = shard->doorkeeper[slot] == hash;
+    shard->doorkeeper[slot] = admit ? 0 : hash;
+    if (admit) {
+        shard->admitted++;
+    } else {
+        shard->rejected++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return admit;
+}
+
+// Function to store a copy of path's contents, unless the path changed since blockCacheGet handed out generation
+void blockCachePut(BlockCache *cache, const char *path, const char *data, size_t size, unsigned long generation) {
+    if (!cache || size > cache->max_file) {
+        return;
+    }
+    char key[4096];
+    normalizePath(path, key, sizeof(key));
+    unsigned int hash = pathHash(key);
+    BlockShard *shard = shardOf(cache, hash);
+
+    CachedBlock *block = (CachedBlock*)calloc(1, sizeof(CachedBlock));
+    char *copy = (char*)malloc(size > 0 ? size : 1);
+    char *name = strdup(key);
+    if (!block || !copy || !name) {
+        free(block);
+        free(copy);
+        free(name);
+        return;
+    }
+    memcpy(copy, data, size);
+    block->path = name;
+    block->data = copy;
+    block->size = size;
+    block->refs = 1;
+
+    CachedBlock *dead = NULL;
+    pthread_mutex_lock(&shard->lock);
+    if (shard->generation != generation || findBlock(shard, key, hash) || size > shard->capacity) {
+        pthread_mutex_unlock(&shard->lock);
+        freeBlock(block);
+        return;
+    }
+    CachedBlock **bucket = &shard->buckets[(hash / BLOCK_CACHE_SHARDS) % shard->bucket_count];
+    block->bucket_next = *bucket;
+    *bucket = block;
+    makeNewest(shard, block);
+    shard->bytes += size;
+    while (shard->bytes > shard->capacity) {
+        CachedBlock *oldest = shard->oldest;
+        shard->evicted++;
+        if (unlinkBlock(shard, oldest)) {
+            oldest->bucket_next = dead;  // Reuse the link to collect them
+            dead = oldest;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    while (dead) {
+        CachedBlock *next = dead->bucket_next;
+        freeBlock(dead);
+        dead = next;
+    }
+}
+
+// Function to return a block from blockCacheGet; it is freed once it is neither cached nor being sent
+void blockCacheRelease(BlockCache *cache, CachedBlock *block) {
+    if (!cache || !block) {
+        return;
+    }
+    BlockShard *shard = shardOf(cache, pathHash(block->path));
+    pthread_mutex_lock(&shard->lock);
+    int last = --block->refs == 0;
+    pthread_mutex_unlock(&shard->lock);
+    if (last) {
+        freeBlock(block);
+    }
+}
+
+// Function to forget one file after it was written; only its shard is touched
+void blockCacheDrop(BlockCache *cache, const char *path) {
+    if (!cache) {
+        return;
+    }
+    char key[4096];
+    normalizePath(path, key, sizeof(key));
+    unsigned int hash = pathHash(key);
+    BlockShard *shard = shardOf(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    shard->generation++;
+    CachedBlock *block = findBlock(shard, key, hash);
+    int last = block && unlinkBlock(shard, block);
+    pthread_mutex_unlock(&shard->lock);
+    if (last) {
+        freeBlock(block);
+    }
+}
+
+// Function to forget path and everything below it, for deletes, copies and renames; walks every shard
+void blockCacheInvalidate(BlockCache *cache, const char *path) {
+    if (!cache) {
+        return;
+    }
+    char prefix[4096];
+    normalizePath(path, prefix, sizeof(prefix));
+    size_t length = strlen(prefix);
+
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        BlockShard *shard = &cache->shards[i];
+        CachedBlock *dead = NULL;
+        pthread_mutex_lock(&shard->lock);
+        shard->generation++;
+        for (CachedBlock *block = shard->newest, *older; block; block = older) {
+            older = block->older;
+            if (strncmp(block->path, prefix, length) == 0 && (block->path[length] == '\0' || block->path[length] == '/') &&
+                unlinkBlock(shard, block)) {
+                block->bucket_next = dead;
+                dead = block;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+        while (dead) {
+            CachedBlock *next = dead->bucket_next;
+            freeBlock(dead);
+            dead = next;
+        }
+    }
+}
+
+// Function to write the counters of all shards as one line of text
+void blockCacheStats(BlockCache *cache, char *buffer, size_t size) {
+    if (!cache) {
+        snprintf(buffer, size, "block cache off");
+        return;
+    }
+    long long hits = 0, misses = 0, admitted = 0, rejected = 0, evicted = 0;
+    size_t bytes = 0, capacity = 0;
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        BlockShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        hits += shard->hits;
+        misses += shard->misses;
+        admitted += shard->admitted;
+        rejected += shard->rejected;
+        evicted += shard->evicted;
+        bytes += shard->bytes;
+        capacity += shard->capacity;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    snprintf(buffer, size, "block cache hits=%lld misses=%lld hit_rate=%.1f%% admitted=%lld rejected=%lld evicted=%lld bytes=%zu/%zu",
+             hits, misses, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0, admitted, rejected, evicted, bytes, capacity);
+}
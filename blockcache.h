@@ -0,0 +1,51 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define BLOCK_CACHE_SHARDS 16                    // Independently locked parts, picked by path hash
+#define BLOCK_CACHE_DEFAULT (64 * 1024 * 1024)   // Bytes of file contents kept by the storage server
+#define BLOCK_CACHE_MAX_FILE (64 * 1024)         // Larger files are always read from disk
+#define BLOCK_CACHE_DOORKEEPER 4096              // Recently missed paths remembered per shard
+
+// Contents of one small file; readers hold a reference while sending from data
+typedef struct CachedBlock {
+    char *path;                    // Normalized
+    char *data;
+    size_t size;
+    int refs;                      // Readers, plus one while the shard holds it
+    struct CachedBlock *bucket_next;
+    struct CachedBlock *newer, *older;
+} CachedBlock;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CachedBlock **buckets;
+    int bucket_count;
+    CachedBlock *newest, *oldest;
+    size_t bytes;
+    size_t capacity;
+    unsigned long generation;      // Bumped whenever a path in this shard may have changed
+    unsigned int doorkeeper[BLOCK_CACHE_DOORKEEPER]; // Hashes of paths missed once
+    long long hits, misses, admitted, rejected, evicted;
+} BlockShard;
+
+// Sharded LRU of whole small files, sized in bytes. A file is only admitted on its second miss, so one-off
+// reads do not push hot files out
+typedef struct {
+    BlockShard shards[BLOCK_CACHE_SHARDS];
+    size_t max_file;
+} BlockCache;
+
+// Function declarations
+BlockCache* createBlockCache(size_t capacity, size_t max_file);
+CachedBlock* blockCacheGet(BlockCache *cache, const char *path, unsigned long *generation);
+int blockCacheAdmit(BlockCache *cache, const char *path, size_t size);
+void blockCachePut(BlockCache *cache, const char *path, const char *data, size_t size, unsigned long generation);
+void blockCacheRelease(BlockCache *cache, CachedBlock *block);
+void blockCacheDrop(BlockCache *cache, const char *path);
+void blockCacheInvalidate(BlockCache *cache, const char *path);
+void blockCacheStats(BlockCache *cache, char *buffer, size_t size);
+
+#endif // BLOCKCACHE_H
@@ -0,0 +1,166 @@
+#include "cap.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// SHA-256 (FIPS 180-4), kept local so neither server needs a crypto library
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+typedef struct {
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t used;        // Bytes waiting in block
+    uint64_t length;    // Total message bytes
+} Sha256;
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256Block(Sha256 *ctx, const unsigned char *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void sha256Init(Sha256 *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->used = 0;
+    ctx->length = 0;
+}
+
+static void sha256Update(Sha256 *ctx, const unsigned char *data, size_t length) {
+    ctx->length += length;
+    while (length > 0) {
+        size_t take = 64 - ctx->used < length ? 64 - ctx->used : length;
+        memcpy(ctx->block + ctx->used, data, take);
+        ctx->used += take;
+        data += take;
+        length -= take;
+        if (ctx->used == 64) {
+            sha256Block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha256Final(Sha256 *ctx, unsigned char out[32]) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad = 0x80;
+    sha256Update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56) {
+        sha256Update(ctx, &pad, 1);
+    }
+    unsigned char length_bytes[8];
+    for (int i = 0; i < 8; i++) {
+        length_bytes[i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256Update(ctx, length_bytes, 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = ctx->state[i] >> 24;
+        out[4 * i + 1] = ctx->state[i] >> 16;
+        out[4 * i + 2] = ctx->state[i] >> 8;
+        out[4 * i + 3] = ctx->state[i];
+    }
+}
+
+// Function to compute HMAC-SHA256 (RFC 2104)
+void hmacSha256(const unsigned char *key, size_t key_length, const unsigned char *message, size_t message_length, unsigned char out[CAP_MAC_SIZE]) {
+    unsigned char block_key[64] = {0};
+    if (key_length > 64) {
+        Sha256 ctx;
+        sha256Init(&ctx);
+        sha256Update(&ctx, key, key_length);
+        sha256Final(&ctx, block_key);
+    } else {
+        memcpy(block_key, key, key_length);
+    }
+
+    unsigned char pad[64];
+    unsigned char inner[32];
+    Sha256 ctx;
+
+    for (int i = 0; i < 64; i++) {
+        pad[i] = block_key[i] ^ 0x36;
+    }
+    sha256Init(&ctx);
+    sha256Update(&ctx, pad, 64);
+    sha256Update(&ctx, message, message_length);
+    sha256Final(&ctx, inner);
+
+    for (int i = 0; i < 64; i++) {
+        pad[i] = block_key[i] ^ 0x5c;
+    }
+    sha256Init(&ctx);
+    sha256Update(&ctx, pad, 64);
+    sha256Update(&ctx, inner, sizeof(inner));
+    sha256Final(&ctx, out);
+}
+
+// The signed message: "<ops> <expiry> <path>\n<chain>"
+static void capMac(const char *key, const char *path, int ops, long long expiry, const char *chain, unsigned char out[CAP_MAC_SIZE]) {
+    char message[600];
+    int length = snprintf(message, sizeof(message), "%d %lld %s\n%s", ops, expiry, path, chain);
+    hmacSha256((const unsigned char *)key, strlen(key), (const unsigned char *)message, (size_t)length, out);
+}
+
+// Function to fill and sign a capability, chain may be NULL
+void capSign(Capability *cap, const char *key, const char *path, int ops, long long expiry, const char *chain) {
+    memset(cap, 0, sizeof(Capability));
+    strncpy(cap->path, path, sizeof(cap->path) - 1);
+    if (chain != NULL) {
+        strncpy(cap->chain, chain, sizeof(cap->chain) - 1);
+    }
+    cap->ops = ops;
+    cap->expiry = expiry;
+    capMac(key, cap->path, ops, expiry, cap->chain, cap->mac);
+}
+
+// Function to check that cap was signed with key, covers path and op, and has not expired. Returns 1 if valid
+int capVerify(const Capability *cap, const char *key, const char *path, int op, long long now) {
+    if ((cap->ops & op) == 0 || cap->expiry < now || strncmp(cap->path, path, sizeof(cap->path)) != 0) {
+        return 0;
+    }
+    char signed_path[sizeof(cap->path) + 1];
+    memcpy(signed_path, cap->path, sizeof(cap->path));
+    signed_path[sizeof(cap->path)] = '\0';
+    char signed_chain[sizeof(cap->chain) + 1];
+    memcpy(signed_chain, cap->chain, sizeof(cap->chain));
+    signed_chain[sizeof(cap->chain)] = '\0';
+
+    unsigned char expected[CAP_MAC_SIZE];
+    capMac(key, signed_path, cap->ops, cap->expiry, signed_chain, expected);
+    unsigned char diff = 0;
+    for (int i = 0; i < CAP_MAC_SIZE; i++) {
+        diff |= expected[i] ^ cap->mac[i];  // Constant time, no early exit
+    }
+    return diff == 0;
+}
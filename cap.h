@@ -0,0 +1,26 @@
+#ifndef CAP_H
+#define CAP_H
+
+#include <stddef.h>
+
+#define CAP_READ 1   // READ and STREAM
+#define CAP_WRITE 2  // WRITE and UPLOAD
+#define CAP_MAC_SIZE 32
+#define DEFAULT_CAP_TTL 60 // Seconds a capability stays valid
+
+// Capability the naming server hands out with a storage server location: the holder may perform ops on path
+// until expiry. mac is HMAC-SHA256 over path, ops, expiry and chain with the key shared by naming and storage servers
+typedef struct {
+    char path[256];
+    int ops;                          // CAP_READ | CAP_WRITE
+    long long expiry;                 // Unix time
+    unsigned char mac[CAP_MAC_SIZE];
+    char chain[256];                  // Replicas a WRITE may be forwarded to, "ip:port,ip:port", empty for reads
+} Capability;
+
+// Function declarations
+void hmacSha256(const unsigned char *key, size_t key_length, const unsigned char *message, size_t message_length, unsigned char out[CAP_MAC_SIZE]);
+void capSign(Capability *cap, const char *key, const char *path, int ops, long long expiry, const char *chain);
+int capVerify(const Capability *cap, const char *key, const char *path, int op, long long now);
+
+#endif // CAP_H
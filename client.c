@@ -1,6 +1,8 @@
 #include "headers.h" // Ensure this includes standard libraries and necessary headers for the client
 #include "signal.h"
 #include "wait.h"
+#include <fcntl.h>
+#include <sys/sendfile.h>
 // Define constants
 #define MAX_PATH_SIZE 4099
 #define BUFFER_SIZE 4099
@@ -18,7 +20,8 @@ typedef struct
     char operation[32];
     char src_path[256];
     char dest_path[256];
-    char data[999999];
+    char data[1024]; // Must match the storage server's Request layout byte for byte
+    Capability cap;  // Handed out by the naming server with the location
 
 } Request;
 
@@ -34,8 +37,49 @@ typedef struct
     char ip[INET_ADDRSTRLEN]; // IP address of the storage server
     int ss_port;              // Storage server port
     int server_index;         // Index of the storage server
+    char chain[256];          // Downstream replicas the storage server forwards a WRITE to
+    Capability cap;           // Signed grant for this path, presented to the storage server
 } ServerInfo;
 
+#define ROUTE_MAX_HOPS 3     // Redirects followed before giving up on a command
+#define NM_THROTTLED -3       // Naming server refused the request, retry after throttle_retry_ms
+#define THROTTLE_MAX_RETRIES 5 // Throttled attempts before giving up on a command
+
+RouteTable routes;                                // Cached routing table of the naming service shards
+NamingServerConnection shard_conns[MAX_ROUTES];   // Open connections to shards other than the home server
+int shard_conn_count = 0;
+NamingServerConnection *home_conn;                // Naming server given on the command line
+int create_kind, create_index;                    // CREATE answers, asked once and resent on a redirect
+int throttle_retry_ms;                            // Delay asked for by the last throttled reply
+char upload_file[MAX_PATH_SIZE];                  // Local file sent by the current UPLOAD
+#define UPLOAD_CHUNK (1024 * 1024)                // Bytes per UPLOAD chunk
+
+typedef struct
+{
+    char path[256]; // Path (and everything under it) whose location changed, "" for every path
+} Invalidation;
+
+#define LOCATION_SLOTS 512        // Direct-mapped location cache
+#define DEFAULT_LOCATION_TTL 30   // Seconds a cached location is trusted, CLIENT_CACHE_TTL overrides
+
+typedef struct
+{
+    char path[256];
+    ServerInfo server; // Storage server the naming server handed out for the path
+    time_t expires;    // 0 when the slot is empty
+} LocationEntry;
+
+LocationEntry locations[LOCATION_SLOTS];
+int location_ttl = DEFAULT_LOCATION_TTL; // 0 disables the cache
+pthread_mutex_t location_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct
+{
+    int count;  // Entries in this page
+    int more;   // 1 if another page follows, continue from the last path
+    int length; // Bytes of "<server index> <path>\n" lines following this header
+} ListPage;
+
 typedef struct
 {
     char ip[50];
@@ -47,15 +91,16 @@ typedef struct
     char file_path_org[1000];
 } StorageServerInfo;
 
-struct FileMetadata
+typedef struct
 {
-    char file_path[1024];
-    long long file_size;
-    int access_rights;
-    char last_accessed[1024];
-    char last_modified[1024];
-    char last_status_change[1024];
-};
+    char kind; // 'U' metadata valid, 'D' no such path, 'E' storage server could not be asked
+    char path[256];
+    long long size;
+    int mode;
+    long long atime;
+    long long mtime;
+    long long ctime;
+} MetaRecord;
 
 void playAudio(int socket)
 {
@@ -254,7 +299,7 @@ void send_request(NamingServerConnection *ns_conn, const char *request)
 ServerInfo receive_server_info(NamingServerConnection *ns_conn)
 {
     ServerInfo server_info;
-    ssize_t bytes_received = recv(ns_conn->socket_fd, &server_info, sizeof(ServerInfo), 0);
+    ssize_t bytes_received = recv(ns_conn->socket_fd, &server_info, sizeof(ServerInfo), MSG_WAITALL);
 
     if (bytes_received <= 0)
     {
@@ -288,7 +333,18 @@ void parse_request(Request *client_args, const char *request)
     }
     strcpy(client_args->operation, operation);
 
-    if (strstr(request, "READ") || strstr(request, "STREAM") || strstr(request, "GET_INFO"))
+    if (strcmp(operation, "UPLOAD") == 0)
+    {
+        // The local file travels as the body of the request, see send_upload
+        char *path = strtok(NULL, " ");
+        if (!path)
+        {
+            fprintf(stderr, "Error: Missing path in UPLOAD request\n");
+            return;
+        }
+        strcpy(client_args->src_path, path);
+    }
+    else if (strstr(request, "READ") || strstr(request, "STREAM"))
     {
         printf("hiii\n");
         char *path = strtok(NULL, " ");
@@ -298,6 +354,12 @@ void parse_request(Request *client_args, const char *request)
             return;
         }
         strcpy(client_args->src_path, path);
+
+        // READ <path> [offset [length]] asks for a slice of the file
+        char *offset = strtok(NULL, " ");
+        char *length = strtok(NULL, " ");
+        if (strcmp(operation, "READ") == 0 && offset != NULL)
+            snprintf(client_args->data, sizeof(client_args->data), "%lld %lld", atoll(offset), length ? atoll(length) : -1LL);
     }
     else if (strstr(request, "WRITE"))
     {
@@ -316,7 +378,10 @@ void parse_request(Request *client_args, const char *request)
             //  exit(EXIT_FAILURE);
             return;
         }
-        strncpy(client_args->data, data, strlen(data) - 1);
+        size_t data_len = strlen(data) - 1;
+        if (data_len > sizeof(client_args->data) - 1)
+            data_len = sizeof(client_args->data) - 1;
+        strncpy(client_args->data, data, data_len);
     }
     else
     {
@@ -342,86 +407,116 @@ void receive_acknowledgment(int ss_sock)
     printf("Acknowledgment from server: %s\n", ack_buffer);
 }
 
-void handle_server_response(NamingServerConnection *ns_conn, int ss_sock, const char *operation)
+// Body of an UPLOAD: the file in chunks of a long long length header and the bytes, then a zero length.
+// On failure the caller shuts the connection down before the zero length, so the storage server discards the upload
+int send_upload(int ss_sock, const char *local_path)
 {
-    if (strcmp(operation, "STREAM") == 0)
+    long long end = 0;
+    struct stat st;
+    int fd = open(local_path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
     {
-        playAudio(ss_sock);
+        if (fd >= 0)
+            close(fd);
+        return -1;
     }
-    else if (strcmp(operation, "GET_INFO") == 0)
-    {
-        struct FileMetadata *file_info = malloc(sizeof(struct FileMetadata));
-        if (!file_info)
-        {
-            perror("Memory allocation failed");
-            close(ss_sock);
-            return;
-        }
 
-        // Receive the FileMetadata struct from the server
-        ssize_t bytes_received = recv(ss_sock, file_info, sizeof(struct FileMetadata), 0);
-        if (bytes_received <= 0)
+    off_t offset = 0;
+    while (offset < st.st_size)
+    {
+        long long length = st.st_size - offset > UPLOAD_CHUNK ? UPLOAD_CHUNK : st.st_size - offset;
+        if (send(ss_sock, &length, sizeof(length), 0) != sizeof(length))
+            break;
+        off_t chunk_end = offset + length;
+        while (offset < chunk_end)
         {
-            perror("Error receiving data");
-            //   free(file_info);
-            close(ss_sock);
-            return;
+            ssize_t sent = sendfile(ss_sock, fd, &offset, (size_t)(chunk_end - offset));
+            if (sent <= 0)
+                break;
         }
+        if (offset != chunk_end)
+            break;
+    }
+    close(fd);
+    if (offset != st.st_size)
+        return -1;
+    return send(ss_sock, &end, sizeof(end), 0) == sizeof(end) ? 0 : -1;
+}
 
-        // Print the received file information
-        printf("File Path: %s\n", file_info->file_path);
-        printf("File Size: %lld bytes\n", file_info->file_size);
-        printf("Access Rights: %d\n", file_info->access_rights);
-        printf("Last Accessed: %s\n", file_info->last_accessed);
-        printf("Last Modified: %s\n", file_info->last_modified);
-        printf("Last Status Change: %s\n", file_info->last_status_change);
-
-        int ack;
+void handle_server_response(NamingServerConnection *ns_conn, int ss_sock, const char *operation)
+{
+    if (strcmp(operation, "STREAM") == 0)
+    {
+        playAudio(ss_sock);
 
-        size_t aaa = recv(ss_sock, &ack, sizeof(int), 0);
-        char ack_buffer[ACK_LENGTH];
-        if (ack == 0)
-        {
-            strcpy(ack_buffer, "GET_INFO succesful");
-            printf("GET_INFO succesful\n");
+        // Lets the naming server stop counting this stream against the storage server
+        char ack_buffer[ACK_LENGTH] = "Stream succesful";
+        if (ns_conn != NULL)
             send(ns_conn->socket_fd, ack_buffer, sizeof(ack_buffer), 0);
-        }
-        else
-        {
-            strcpy(ack_buffer, "GET_INFO failed");
-            send(ns_conn->socket_fd, ack_buffer, sizeof(ack_buffer), 0);
-        }
     }
     else if (strcmp(operation, "READ") == 0)
     {
-        // Receive file content
-        char response_buffer[BUFFER_SIZE];
-        ssize_t bytes_received = recv(ss_sock, response_buffer, sizeof(response_buffer) - 1, 0);
-        if (bytes_received > 0)
+        // Length header, then the whole file in as many receives as it takes
+        long long length = -1;
+        if (recv(ss_sock, &length, sizeof(length), MSG_WAITALL) != sizeof(length))
         {
-            response_buffer[bytes_received] = '\0'; // Null-terminate the response
-            printf("Received file content: %s\n", response_buffer);
+            perror("Failed to receive file content");
+        }
+        else if (length < 0)
+        {
+            printf("Storage server could not open the file\n");
         }
         else
         {
-            perror("Failed to receive file content");
+            char response_buffer[BUFFER_SIZE];
+            long long received = 0;
+            printf("Received file content: ");
+            while (received < length)
+            {
+                size_t remaining = (size_t)(length - received); // Positive, received < length
+                size_t want = remaining > sizeof(response_buffer) ? sizeof(response_buffer) : remaining;
+                ssize_t bytes_received = recv(ss_sock, response_buffer, want, 0);
+                if (bytes_received <= 0)
+                {
+                    perror("Failed to receive file content");
+                    break;
+                }
+                fwrite(response_buffer, 1, bytes_received, stdout);
+                received += bytes_received;
+            }
+            printf("\n");
         }
 
-        int ack;
+        int ack = -1;
 
-        size_t aaa = recv(ss_sock, &ack, sizeof(int), 0);
+        size_t aaa = recv(ss_sock, &ack, sizeof(int), MSG_WAITALL);
         char ack_buffer[ACK_LENGTH];
         if (ack == 0)
         {
             strcpy(ack_buffer, "Read succesful");
             printf("Read succesful\n");
-            send(ns_conn->socket_fd, ack_buffer, sizeof(ack_buffer), 0);
         }
         else
         {
             strcpy(ack_buffer, "Read failed");
+        }
+        if (ns_conn != NULL) // NULL when the location came from the cache
             send(ns_conn->socket_fd, ack_buffer, sizeof(ack_buffer), 0);
+    }
+    else if (strcmp(operation, "UPLOAD") == 0)
+    {
+        char ack_buffer[ACK_LENGTH] = "Upload failed";
+        if (send_upload(ss_sock, upload_file) != 0)
+        {
+            perror("Failed to send the file");
+            shutdown(ss_sock, SHUT_WR);
         }
+        ssize_t bytes_received = recv(ss_sock, ack_buffer, sizeof(ack_buffer) - 1, 0);
+        if (bytes_received > 0)
+            ack_buffer[bytes_received] = '\0';
+        printf("Acknowledgment from server: %s\n", ack_buffer);
+        if (ns_conn != NULL)
+            send(ns_conn->socket_fd, ack_buffer, sizeof(ack_buffer), 0);
     }
     else if (strstr("WRITE", operation) != NULL)
     {
@@ -474,21 +569,154 @@ void handle_server_response(NamingServerConnection *ns_conn, int ss_sock, const
     }
 }
 
-void ss_client(NamingServerConnection *ns_conn, const char *request)
+unsigned int location_slot(const char *path)
 {
-    send_request(ns_conn, request);
+    unsigned int hash = 5381;
+    for (const char *p = path; *p; p++)
+        hash = hash * 33 + (unsigned char)*p;
+    return hash % LOCATION_SLOTS;
+}
 
-    ServerInfo server_info = receive_server_info(ns_conn);
+// Cached storage server for path, 0 on a miss or an expired entry
+int location_lookup(const char *path, ServerInfo *server)
+{
+    int hit = 0;
+    pthread_mutex_lock(&location_lock);
+    LocationEntry *entry = &locations[location_slot(path)];
+    if (location_ttl > 0 && entry->expires > time(NULL) && strcmp(entry->path, path) == 0)
+    {
+        *server = entry->server;
+        hit = 1;
+    }
+    pthread_mutex_unlock(&location_lock);
+    return hit;
+}
+
+void location_store(const char *path, const ServerInfo *server)
+{
+    pthread_mutex_lock(&location_lock);
+    if (location_ttl > 0)
+    {
+        LocationEntry *entry = &locations[location_slot(path)];
+        strncpy(entry->path, path, sizeof(entry->path) - 1);
+        entry->server = *server;
+        entry->expires = time(NULL) + location_ttl;
+        // Past its capability's expiry the storage server would refuse us, ask the naming server again
+        if (server->cap.expiry != 0 && server->cap.expiry < entry->expires)
+            entry->expires = server->cap.expiry;
+    }
+    pthread_mutex_unlock(&location_lock);
+}
+
+// Drop cached locations for path and everything under it, "" drops them all
+void location_forget(const char *path)
+{
+    size_t length = strlen(path);
+    pthread_mutex_lock(&location_lock);
+    for (int i = 0; i < LOCATION_SLOTS; i++)
+    {
+        if (locations[i].expires != 0 && strncmp(locations[i].path, path, length) == 0)
+            locations[i].expires = 0;
+    }
+    pthread_mutex_unlock(&location_lock);
+}
+
+// Apply invalidations pushed by a naming server; if the feed breaks, caching stops since nothing keeps it fresh
+void *invalidation_listener(void *arg)
+{
+    int fd = *(int *)arg;
+    free(arg);
+    Invalidation message;
+    while (recv(fd, &message, sizeof(message), MSG_WAITALL) == sizeof(message))
+    {
+        message.path[sizeof(message.path) - 1] = '\0';
+        location_forget(message.path);
+    }
+    pthread_mutex_lock(&location_lock);
+    location_ttl = 0;
+    pthread_mutex_unlock(&location_lock);
+    location_forget("");
+    close(fd);
+    return NULL;
+}
+
+// Open a second connection to a naming server that only carries location invalidations
+void subscribe_invalidations(NamingServerConnection *ns_conn)
+{
+    if (location_ttl <= 0)
+        return;
+    int *fd = malloc(sizeof(int));
+    *fd = socket(AF_INET, SOCK_STREAM, 0);
+    pthread_t listener;
+    if (*fd < 0 || connect(*fd, (struct sockaddr *)&ns_conn->server_address, sizeof(ns_conn->server_address)) < 0 ||
+        send(*fd, "SUBSCRIBE", strlen("SUBSCRIBE"), 0) < 0 || pthread_create(&listener, NULL, invalidation_listener, fd) != 0)
+    {
+        perror("Failed to subscribe to invalidations, location cache disabled");
+        if (*fd >= 0)
+            close(*fd);
+        free(fd);
+        location_ttl = 0;
+        return;
+    }
+    pthread_detach(listener);
+}
+
+int ss_client(NamingServerConnection *ns_conn, const char *request)
+{
+    // READ and STREAM of a recently resolved path go straight to the storage server
+    char operation[32] = "", path[256] = "";
+    sscanf(request, "%31s %255s", operation, path);
+    int cacheable = strcmp(operation, "READ") == 0 || strcmp(operation, "STREAM") == 0;
+    ServerInfo server_info;
+    if (cacheable && location_lookup(path, &server_info))
+    {
+        int ss_sock = connect_to_storage_server(server_info.ip, server_info.ss_port);
+        if (ss_sock < 0)
+        {
+            location_forget(path);
+            return ss_client(ns_conn, request);
+        }
+        Request *client_args = calloc(1, sizeof(Request));
+        parse_request(client_args, request);
+        client_args->cap = server_info.cap;
+        if (send(ss_sock, client_args, sizeof(Request), 0) < 0)
+            perror("Failed to send data");
+        handle_server_response(NULL, ss_sock, client_args->operation);
+        free(client_args);
+        close(ss_sock);
+        return 0;
+    }
+
+    if (strcmp(operation, "UPLOAD") == 0)
+    {
+        // To the naming server an upload is a WRITE: it builds the replica chain and grants write access
+        char nm_request[300];
+        snprintf(nm_request, sizeof(nm_request), "WRITE %s", path);
+        send_request(ns_conn, nm_request);
+    }
+    else
+        send_request(ns_conn, request);
+
+    server_info = receive_server_info(ns_conn);
+    if (server_info.server_index == ROUTE_REDIRECT)
+        return ROUTE_REDIRECT;
+    if (server_info.server_index == NM_THROTTLED)
+    {
+        throttle_retry_ms = server_info.ss_port;
+        return NM_THROTTLED;
+    }
     if (server_info.server_index < 0)
     {
         char ack_buffer[256] = "No such storage server found";
         send(ns_conn->socket_fd, ack_buffer, sizeof(ack_buffer), 0);
         printf("Such Storage Server doesn't exsist\n");
-        return;
+        return 0;
     }
+    if (cacheable)
+        location_store(path, &server_info);
     int ss_sock = connect_to_storage_server(server_info.ip, server_info.ss_port);
 
-    Request *client_args = malloc(sizeof(Request));
+    Request *client_args = calloc(1, sizeof(Request));
     if (!client_args)
     {
         perror("Failed to allocate memory for Request");
@@ -497,6 +725,9 @@ void ss_client(NamingServerConnection *ns_conn, const char *request)
     }
 
     parse_request(client_args, request);
+    client_args->cap = server_info.cap;
+    if (strcmp(client_args->operation, "WRITE") == 0 || strcmp(client_args->operation, "UPLOAD") == 0)
+        snprintf(client_args->dest_path, sizeof(client_args->dest_path), "%s", server_info.chain);
 
     if (send(ss_sock, client_args, sizeof(Request), 0) < 0)
     {
@@ -512,29 +743,74 @@ void ss_client(NamingServerConnection *ns_conn, const char *request)
 
     // free(client_args);
     close(ss_sock);
+    return 0;
 }
 
-void nm_client(NamingServerConnection *ns_conn, const char *request)
+int nm_client(NamingServerConnection *ns_conn, const char *request)
 {
     if (send(ns_conn->socket_fd, request, strlen(request), 0) < 0)
     {
         perror("Failed to send request");
-        return;
+        return 0;
     }
 
-    if (strstr(request, "CREATE") != NULL)
+    if (strncmp(request, "GET_INFO", 8) == 0 || strncmp(request, "STAT ", 5) == 0)
+    {
+        // The naming server answers from its metadata cache, no storage server connection needed
+        int count = 0;
+        if (recv(ns_conn->socket_fd, &count, sizeof(int), MSG_WAITALL) != sizeof(int))
+        {
+            perror("Failed to receive metadata");
+            return 0;
+        }
+        if (count == ROUTE_REDIRECT)
+            return ROUTE_REDIRECT;
+        if (count == NM_THROTTLED)
+        {
+            recv(ns_conn->socket_fd, &throttle_retry_ms, sizeof(int), MSG_WAITALL);
+            return NM_THROTTLED;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            MetaRecord record;
+            if (recv(ns_conn->socket_fd, &record, sizeof(record), MSG_WAITALL) != sizeof(record))
+            {
+                perror("Failed to receive metadata");
+                return 0;
+            }
+            if (record.kind == 'D')
+            {
+                printf("%s: no such path\n", record.path);
+                continue;
+            }
+            if (record.kind != 'U')
+            {
+                printf("%s: storage server unavailable\n", record.path);
+                continue;
+            }
+            time_t atime = (time_t)record.atime;
+            time_t mtime = (time_t)record.mtime;
+            time_t ctime_ = (time_t)record.ctime;
+            printf("File Path: %s\n", record.path);
+            printf("File Size: %lld bytes\n", record.size);
+            printf("Access Rights: %o\n", record.mode & 0777);
+            printf("Last Accessed: %s", ctime(&atime));
+            printf("Last Modified: %s", ctime(&mtime));
+            printf("Last Status Change: %s", ctime(&ctime_));
+        }
+    }
+    else if (strstr(request, "CREATE") != NULL)
     {
-        int x;
-        printf("Enter 1 to Create a File or Enter 0 to Create a Folder: ");
-        scanf("%d", &x);
-        send(ns_conn->socket_fd, &x, sizeof(int), 0);
-        int server_index;
-        printf("Enter the ss index in which file is to be created: ");
-        scanf("%d", &server_index);
-        send(ns_conn->socket_fd, &server_index, sizeof(int), 0);
+        // Answers were asked for before routing, so a redirect can resend them
+        send(ns_conn->socket_fd, &create_kind, sizeof(int), 0);
+        send(ns_conn->socket_fd, &create_index, sizeof(int), 0);
         char buf[256] = {0};
         size_t bytesrecv;                                              // Ensure buffer is cleared
         bytesrecv = recv(ns_conn->socket_fd, buf, sizeof(buf) - 1, 0); // -1 for null terminator
+        if (strncmp(buf, "REDIRECT ", 9) == 0)
+            return ROUTE_REDIRECT;
+        if (sscanf(buf, "RETRY_AFTER %d", &throttle_retry_ms) == 1)
+            return NM_THROTTLED;
         printf("recieved acknowledgement from nm:%s\n", buf);
     }
     else if (strstr(request, "DELETE") != NULL || strstr(request, "COPY") != NULL)
@@ -542,61 +818,166 @@ void nm_client(NamingServerConnection *ns_conn, const char *request)
         char buf[256] = {0};
         size_t bytesrecv;                                              // Ensure buffer is cleared
         bytesrecv = recv(ns_conn->socket_fd, buf, sizeof(buf) - 1, 0); // -1 for null terminator
+        if (strncmp(buf, "REDIRECT ", 9) == 0)
+            return ROUTE_REDIRECT;
+        if (sscanf(buf, "RETRY_AFTER %d", &throttle_retry_ms) == 1)
+            return NM_THROTTLED;
         printf("recieved acknowledgement from nm:%s\n", buf);
     }
+    else if (strncmp(request, "STATS", 5) == 0)
+    {
+        char buf[1024] = {0};
+        recv(ns_conn->socket_fd, buf, sizeof(buf) - 1, 0);
+        printf("%s\n", buf);
+    }
     else if (strstr(request, "LIST") != NULL)
     {
-        int size = 0;
-        ssize_t bytesrecv;
-
-        // Receive the size of the list
-        bytesrecv = recv(ns_conn->socket_fd, &size, sizeof(int), 0);
-        if (bytesrecv <= 0)
+        ListPage page;
+        if (recv(ns_conn->socket_fd, &page, sizeof(page), MSG_WAITALL) != sizeof(page))
+        {
+            perror("Failed to receive list page");
+            return 0;
+        }
+        if (page.count == ROUTE_REDIRECT)
+            return ROUTE_REDIRECT;
+        if (page.count == NM_THROTTLED)
         {
-            if (bytesrecv == 0)
-                fprintf(stderr, "Connection closed by peer.\n");
-            else
-                perror("Failed to receive size of list");
-            return; // Exit or handle gracefully
+            throttle_retry_ms = page.more;
+            return NM_THROTTLED;
         }
 
-        printf("size: %d\n", size);
-        if (size == 0)
+        char *entries = malloc(page.length + 1);
+        if (entries == NULL || (page.length > 0 && recv(ns_conn->socket_fd, entries, page.length, MSG_WAITALL) != page.length))
         {
+            perror("Failed to receive list entries");
+            free(entries);
+            return 0;
+        }
+        entries[page.length] = '\0';
+
+        if (page.count == 0)
             printf("No files found\n");
-            return;
+        else
+            printf("%s", entries);
+
+        if (page.more)
+        {
+            // The last listed path is the cursor for the next page
+            entries[page.length - 1] = '\0';
+            char *last = strrchr(entries, '\n');
+            last = last ? last + 1 : entries;
+            char *cursor = strchr(last, ' ');
+            char prefix[256] = "";
+            sscanf(request, "LIST %255s", prefix);
+            printf("More entries: LIST %s %s %d\n", prefix[0] ? prefix : "/", cursor ? cursor + 1 : "-", page.count);
         }
-        // Loop to receive `size` number of entries
-        while (size--)
+        free(entries);
+
+        char ack[ACK_LENGTH] = "List succesful";
+        send(ns_conn->socket_fd, ack, sizeof(ack), 0);
+    }
+    return 0;
+}
+
+// Fetch the shard routing table from a naming server, an empty table means it owns every path
+void fetch_routes(NamingServerConnection *ns_conn)
+{
+    int count = 0;
+    send(ns_conn->socket_fd, "ROUTES", strlen("ROUTES"), 0);
+    if (recv(ns_conn->socket_fd, &count, sizeof(int), MSG_WAITALL) != sizeof(int) || count < 0 || count > MAX_ROUTES)
+    {
+        perror("Failed to receive routing table");
+        routes.count = 0;
+        return;
+    }
+    ssize_t table_size = (ssize_t)(count * sizeof(RouteEntry));
+    if (count > 0 && recv(ns_conn->socket_fd, routes.entries, table_size, MSG_WAITALL) != table_size)
+    {
+        perror("Failed to receive routing table");
+        count = 0;
+    }
+    routes.count = count;
+}
+
+// The naming server owning a path according to the cached table, connecting to it on first use
+NamingServerConnection *connection_for(const char *path)
+{
+    const RouteEntry *route = routes.count > 0 && path != NULL ? routeLookup(&routes, path) : NULL;
+    if (route == NULL || (route->port == ntohs(home_conn->server_address.sin_port) &&
+                          inet_addr(route->ip) == home_conn->server_address.sin_addr.s_addr))
+        return home_conn;
+
+    for (int i = 0; i < shard_conn_count; i++)
+    {
+        if (route->port == ntohs(shard_conns[i].server_address.sin_port) &&
+            inet_addr(route->ip) == shard_conns[i].server_address.sin_addr.s_addr)
+            return &shard_conns[i];
+    }
+    if (shard_conn_count == MAX_ROUTES || connect_to_naming_server(&shard_conns[shard_conn_count], route->ip, route->port) < 0)
+        return home_conn; // It redirects us if the path is really elsewhere
+    subscribe_invalidations(&shard_conns[shard_conn_count]);
+    return &shard_conns[shard_conn_count++];
+}
+
+// Run a command against the shard owning path, refreshing the table and retrying when a shard redirects us
+void route_command(const char *input, const char *path, int (*handler)(NamingServerConnection *, const char *))
+{
+    int hops = 0, throttled = 0;
+    while (hops < ROUTE_MAX_HOPS && throttled < THROTTLE_MAX_RETRIES)
+    {
+        NamingServerConnection *ns_conn = connection_for(path);
+        int result = handler(ns_conn, input);
+        if (result == NM_THROTTLED)
         {
-            int idx;
-            bytesrecv = recv(ns_conn->socket_fd, &idx, sizeof(int), 0);
-            if (bytesrecv <= 0)
-            {
-                if (bytesrecv == 0)
-                    fprintf(stderr, "Connection closed while receiving index.\n");
-                else
-                    perror("Failed to receive index");
-                return; // Exit or handle gracefully
-            }
+            // Back off as long as the naming server asked before trying again
+            printf("Naming server is busy, retrying in %d ms\n", throttle_retry_ms);
+            usleep(throttle_retry_ms * 1000);
+            throttled++;
+            continue;
+        }
+        if (result != ROUTE_REDIRECT)
+            return;
+        printf("Path belongs to another naming server, refreshing routes\n");
+        fetch_routes(ns_conn);
+        hops++;
+    }
+    printf("Giving up on %s\n", input);
+}
+
+// STAT paths may span shards: ask each shard for its own paths
+void stat_by_shard(const char *input)
+{
+    char *copy = strdup(input);
+    char *paths[64];
+    int owner[64];
+    int count = 0;
+    strtok(copy, " ");
+    for (char *path = strtok(NULL, " "); path != NULL && count < 64; path = strtok(NULL, " "))
+    {
+        const RouteEntry *route = routes.count > 0 ? routeLookup(&routes, path) : NULL;
+        owner[count] = route ? (int)(route - routes.entries) : -1;
+        paths[count++] = path;
+    }
 
-            char buf[10000] = {0};                                         // Ensure buffer is cleared
-            bytesrecv = recv(ns_conn->socket_fd, buf, sizeof(buf) - 1, 0); // -1 for null terminator
-            if (bytesrecv <= 0)
+    for (int i = 0; i < count; i++)
+    {
+        if (paths[i] == NULL)
+            continue;
+        char command[6500] = "STAT";
+        for (int j = i; j < count; j++)
+        {
+            if (paths[j] != NULL && owner[j] == owner[i] && strlen(command) + strlen(paths[j]) + 2 < sizeof(command))
             {
-                if (bytesrecv == 0)
-                    fprintf(stderr, "Connection closed while receiving data.\n");
-                else
-                    perror("Failed to receive data");
-                return; // Exit or handle gracefully
+                strcat(command, " ");
+                strcat(command, paths[j]);
+                if (j != i)
+                    paths[j] = NULL;
             }
-
-            buf[bytesrecv] = '\0'; // Null-terminate the received string
-            printf("Index: %d, Data: %s\n", idx, buf);
         }
-        char ack[ACK_LENGTH] = "List succesful";
-        send(ns_conn->socket_fd, ack, sizeof(ack), 0);
+        route_command(command, paths[i], nm_client);
+        paths[i] = NULL;
     }
+    free(copy);
 }
 
 // Main function
@@ -617,11 +998,17 @@ int main(int argc, char *argv[])
     {
         return EXIT_FAILURE;
     }
+    home_conn = &ns_conn;
+    fetch_routes(&ns_conn);
+    location_ttl = getenv("CLIENT_CACHE_TTL") ? atoi(getenv("CLIENT_CACHE_TTL")) : DEFAULT_LOCATION_TTL;
+    subscribe_invalidations(&ns_conn);
+    if (routes.count > 0)
+        printf("Naming service has %d shards\n", routes.count);
 
     char input[999999];
     while (1)
     {
-        printf("Enter command (READ <path>, WRITE <path> <data>, or QUIT to exit): ");
+        printf("Enter command (READ <path> [offset length], WRITE <path> <data>, UPLOAD <path> <local file>, or QUIT to exit): ");
         if (!fgets(input, sizeof(input), stdin))
             break;
 
@@ -638,14 +1025,46 @@ int main(int argc, char *argv[])
             return 0;
         }
 
-        if (strncmp(input, "READ", 4) == 0 || strncmp(input, "STREAM", 6) == 0 ||
-            strncmp(input, "WRITE", 5) == 0 || strstr(input, "GET_INFO") != NULL)
+        if (strncmp(input, "UPLOAD", 6) == 0)
+        {
+            char path[256] = "";
+            upload_file[0] = '\0';
+            sscanf(input, "%*s %255s %4098s", path, upload_file);
+            if (access(upload_file, R_OK) != 0)
+            {
+                printf("Cannot read local file %s\n", upload_file);
+                continue;
+            }
+            route_command(input, path, ss_client);
+        }
+        else if (strncmp(input, "READ", 4) == 0 || strncmp(input, "STREAM", 6) == 0 ||
+                 strncmp(input, "WRITE", 5) == 0)
         {
-            ss_client(&ns_conn, input);
+            char path[256] = "";
+            sscanf(input, "%*s %255s", path);
+            route_command(input, path, ss_client);
         }
-        else if (strncmp(input, "CREATE", 6) == 0 || strncmp(input, "DELETE", 6) == 0 || strncmp(input, "COPY", 4) == 0 || strstr(input, "LIST") != NULL)
+        else if (strncmp(input, "STATS", 5) == 0)
         {
-            nm_client(&ns_conn, input);
+            route_command(input, NULL, nm_client);
+        }
+        else if (strncmp(input, "STAT", 4) == 0)
+        {
+            stat_by_shard(input);
+        }
+        else if (strncmp(input, "CREATE", 6) == 0 || strncmp(input, "DELETE", 6) == 0 || strncmp(input, "COPY", 4) == 0 || strstr(input, "LIST") != NULL ||
+                 strncmp(input, "GET_INFO", 8) == 0)
+        {
+            if (strncmp(input, "CREATE", 6) == 0)
+            {
+                printf("Enter 1 to Create a File or Enter 0 to Create a Folder: ");
+                scanf("%d", &create_kind);
+                printf("Enter the ss index in which file is to be created: ");
+                scanf("%d", &create_index);
+            }
+            char path[256] = "";
+            sscanf(input, "%*s %255s", path);
+            route_command(input, path, nm_client);
         }
         else
         {
@@ -0,0 +1,238 @@
+#include "fdcache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Function to create a cache holding at most capacity descriptors, 0 for none
+FdCache* createFdCache(int capacity) {
+    FdCache *cache = (FdCache*)calloc(1, sizeof(FdCache));
+    if (!cache) {
+        perror("Descriptor cache allocation failed");
+        return NULL;
+    }
+    cache->capacity = capacity > 0 ? capacity : 0;
+    cache->bucket_count = cache->capacity > 0 ? cache->capacity * 2 : 1;
+    cache->buckets = (CachedFd**)calloc(cache->bucket_count, sizeof(CachedFd*));
+    if (!cache->buckets) {
+        perror("Descriptor cache allocation failed");
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+// Collapse repeated slashes and drop a trailing one, so "//a/b/" and "/a/b" share an entry
+static char* normalizePath(const char *path) {
+    char *out = (char*)malloc(strlen(path) + 1);
+    if (!out) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (const char *p = path; *p; p++) {
+        if (*p != '/' || n == 0 || out[n - 1] != '/') {
+            out[n++] = *p;
+        }
+    }
+    if (n > 1 && out[n - 1] == '/') {
+        n--;
+    }
+    out[n] = '\0';
+    return out;
+}
+
+static unsigned int bucketOf(FdCache *cache, const char *path, int mode) {
+    unsigned int hash = 5381 + mode;
+    for (const unsigned char *p = (const unsigned char*)path; *p; p++) {
+        hash = hash * 33 + *p;
+    }
+    return hash % cache->bucket_count;
+}
+
+static void freeEntry(CachedFd *entry) {
+    close(entry->fd);
+    free(entry->path);
+    free(entry);
+}
+
+// Take entry out of the table and the LRU list; called with the lock held. Returns 1 if nobody borrows it any
+// more and the caller must free it after unlocking
+static int unlinkEntry(FdCache *cache, CachedFd *entry) {
+    CachedFd **link = &cache->buckets[bucketOf(cache, entry->path, entry->mode)];
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+    cache->count--;
+    return --entry->refs == 0;
+}
+
+static void makeNewest(FdCache *cache, CachedFd *entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+static CachedFd* findEntry(FdCache *cache, const char *path, int mode) {
+    for (CachedFd *entry = cache->buckets[bucketOf(cache, path, mode)]; entry; entry = entry->bucket_next) {
+        if (entry->mode == mode && strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Function to borrow a descriptor for path, opening it on a miss. Returns NULL with errno set if the open
+// failed. Readers must use offsets (pread, sendfile with an offset) since the descriptor is shared
+CachedFd* fdCacheOpen(FdCache *cache, const char *path, int mode) {
+    char *key = normalizePath(path);
+    if (!key) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    unsigned long generation = 0;
+    if (cache && cache->capacity > 0) {
+        pthread_mutex_lock(&cache->lock);
+        CachedFd *entry = findEntry(cache, key, mode);
+        if (entry) {
+            entry->refs++;
+            if (cache->newest != entry) {
+                // Unlink from the LRU list only, the table link stays
+                entry->newer->older = entry->older;
+                if (entry->older) {
+                    entry->older->newer = entry->newer;
+                } else {
+                    cache->oldest = entry->newer;
+                }
+                makeNewest(cache, entry);
+            }
+            pthread_mutex_unlock(&cache->lock);
+            free(key);
+            return entry;
+        }
+        generation = cache->generation;
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    // open can block on the disk, keep it outside the lock
+    int fd = mode == FD_CACHE_APPEND ? open(path, O_WRONLY | O_APPEND | O_CREAT, 0666) : open(path, O_RDONLY);
+    if (fd == -1) {
+        free(key);
+        return NULL;
+    }
+    CachedFd *opened = (CachedFd*)calloc(1, sizeof(CachedFd));
+    if (!opened) {
+        close(fd);
+        free(key);
+        errno = ENOMEM;
+        return NULL;
+    }
+    opened->path = key;
+    opened->mode = mode;
+    opened->fd = fd;
+    opened->refs = 1;
+    if (!cache || cache->capacity == 0) {
+        return opened;
+    }
+
+    CachedFd *evicted = NULL;
+    pthread_mutex_lock(&cache->lock);
+    CachedFd *raced = findEntry(cache, key, mode);
+    if (raced) {
+        // Someone else opened it meanwhile, share theirs
+        raced->refs++;
+        pthread_mutex_unlock(&cache->lock);
+        freeEntry(opened);
+        return raced;
+    }
+    // An invalidation while we were opening may have replaced the file, so this one is used once and not kept
+    if (cache->generation == generation) {
+        unsigned int bucket = bucketOf(cache, key, mode);
+        opened->bucket_next = cache->buckets[bucket];
+        cache->buckets[bucket] = opened;
+        makeNewest(cache, opened);
+        opened->refs++;
+        cache->count++;
+        CachedFd *oldest = cache->oldest;
+        if (cache->count > cache->capacity && unlinkEntry(cache, oldest)) {
+            evicted = oldest;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (evicted) {
+        freeEntry(evicted);
+    }
+    return opened;
+}
+
+// Function to return a borrowed descriptor; it is closed once it is neither cached nor borrowed
+void fdCacheRelease(FdCache *cache, CachedFd *entry) {
+    if (!entry) {
+        return;
+    }
+    int last;
+    if (cache) {
+        pthread_mutex_lock(&cache->lock);
+        last = --entry->refs == 0;
+        pthread_mutex_unlock(&cache->lock);
+    } else {
+        last = --entry->refs == 0;
+    }
+    if (last) {
+        freeEntry(entry);
+    }
+}
+
+// Function to drop path and everything below it, for deletes and for files replaced by rename or COPY.
+// Borrowers keep their descriptors until they release them
+void fdCacheInvalidate(FdCache *cache, const char *path) {
+    if (!cache || cache->capacity == 0) {
+        return;
+    }
+    char *prefix = normalizePath(path);
+    if (!prefix) {
+        return;
+    }
+    size_t length = strlen(prefix);
+    CachedFd *dead = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+    CachedFd *entry = cache->newest;
+    while (entry) {
+        CachedFd *older = entry->older;
+        if (strncmp(entry->path, prefix, length) == 0 && (entry->path[length] == '\0' || entry->path[length] == '/')) {
+            if (unlinkEntry(cache, entry)) {
+                entry->bucket_next = dead;  // Reuse the link to collect them
+                dead = entry;
+            }
+        }
+        entry = older;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    while (dead) {
+        CachedFd *next = dead->bucket_next;
+        freeEntry(dead);
+        dead = next;
+    }
+}
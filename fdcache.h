@@ -0,0 +1,37 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <pthread.h>
+
+#define FD_CACHE_DEFAULT 256  // Open descriptors kept by the storage server
+#define FD_CACHE_READ 0       // O_RDONLY
+#define FD_CACHE_APPEND 1     // O_WRONLY | O_APPEND | O_CREAT
+
+// One open descriptor; borrowers hold a reference until fdCacheRelease
+typedef struct CachedFd {
+    char *path;                    // Normalized, see fdCacheOpen
+    int mode;                      // FD_CACHE_READ or FD_CACHE_APPEND
+    int fd;
+    int refs;                      // Borrowers, plus one while the cache holds it
+    struct CachedFd *bucket_next;
+    struct CachedFd *newer, *older;
+} CachedFd;
+
+// Bounded LRU of open descriptors keyed by path and mode
+typedef struct {
+    pthread_mutex_t lock;
+    CachedFd **buckets;
+    int bucket_count;
+    CachedFd *newest, *oldest;
+    int count;
+    int capacity;                  // 0 disables caching, every open is a real open
+    unsigned long generation;      // Bumped by every invalidation
+} FdCache;
+
+// Function declarations
+FdCache* createFdCache(int capacity);
+CachedFd* fdCacheOpen(FdCache *cache, const char *path, int mode);
+void fdCacheRelease(FdCache *cache, CachedFd *entry);
+void fdCacheInvalidate(FdCache *cache, const char *path);
+
+#endif // FDCACHE_H
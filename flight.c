@@ -0,0 +1,85 @@
+#include "flight.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Function to create an empty single-flight group
+FlightGroup* createFlightGroup() {
+    FlightGroup *group = (FlightGroup*)calloc(1, sizeof(FlightGroup));
+    if (!group) {
+        perror("Flight group allocation failed");
+        return NULL;
+    }
+    pthread_mutex_init(&group->lock, NULL);
+    return group;
+}
+
+// Drop a reference, the last one frees the call
+static void releaseCall(FlightCall *call) {
+    if (--call->refs == 0) {
+        pthread_cond_destroy(&call->cond);
+        free(call);
+    }
+}
+
+// Function to join the lookup for key. Returns 1 when the caller leads: it does the work and must call
+// flightFinish with *call. Returns 0 when another caller's lookup finished and its result was copied into result.
+// Keys too long to store whole are never coalesced, two of them sharing a prefix must not share a result
+int flightJoin(FlightGroup *group, const char *key, void *result, size_t size, FlightCall **call) {
+    if (strlen(key) >= FLIGHT_KEY_MAX) {
+        *call = NULL;
+        return 1;  // Do the work uncoalesced
+    }
+    pthread_mutex_lock(&group->lock);
+    for (FlightCall *current = group->calls; current != NULL; current = current->next) {
+        if (strcmp(current->key, key) == 0) {
+            current->refs++;
+            while (!current->done) {
+                pthread_cond_wait(&current->cond, &group->lock);
+            }
+            memcpy(result, current->result, size < current->size ? size : current->size);
+            group->shared++;
+            releaseCall(current);
+            pthread_mutex_unlock(&group->lock);
+            return 0;
+        }
+    }
+
+    FlightCall *leader = (FlightCall*)calloc(1, sizeof(FlightCall));
+    if (leader == NULL) {
+        pthread_mutex_unlock(&group->lock);
+        perror("Flight allocation failed");
+        *call = NULL;
+        return 1;  // Do the work uncoalesced
+    }
+    strcpy(leader->key, key);
+    leader->refs = 1;
+    pthread_cond_init(&leader->cond, NULL);
+    leader->next = group->calls;
+    group->calls = leader;
+    group->leaders++;
+    pthread_mutex_unlock(&group->lock);
+
+    *call = leader;
+    return 1;
+}
+
+// Function to publish the leader's result, wake the waiters and retire the call; later callers start a new lookup
+void flightFinish(FlightGroup *group, FlightCall *call, const void *result, size_t size) {
+    if (call == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&group->lock);
+    for (FlightCall **link = &group->calls; *link != NULL; link = &(*link)->next) {
+        if (*link == call) {
+            *link = call->next;
+            break;
+        }
+    }
+    call->size = size < FLIGHT_RESULT_MAX ? size : FLIGHT_RESULT_MAX;
+    memcpy(call->result, result, call->size);
+    call->done = 1;
+    pthread_cond_broadcast(&call->cond);
+    releaseCall(call);
+    pthread_mutex_unlock(&group->lock);
+}
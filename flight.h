@@ -0,0 +1,34 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define FLIGHT_KEY_MAX 256     // Longer keys (paths) are looked up uncoalesced
+#define FLIGHT_RESULT_MAX 512  // Largest result shared with waiters
+
+// One lookup in progress; concurrent callers with the same key wait for its result
+typedef struct FlightCall {
+    struct FlightCall *next;
+    char key[FLIGHT_KEY_MAX];
+    int done;                               // Set once the leader published the result
+    int refs;                               // Leader plus waiters still reading the call
+    size_t size;                            // Bytes of result
+    unsigned char result[FLIGHT_RESULT_MAX];
+    pthread_cond_t cond;
+} FlightCall;
+
+// Single-flight group: at most one call per key is in progress at a time
+typedef struct {
+    pthread_mutex_t lock;
+    FlightCall *calls;     // Calls in progress
+    long long leaders;     // Lookups actually performed
+    long long shared;      // Callers served by another caller's lookup
+} FlightGroup;
+
+// Function declarations
+FlightGroup* createFlightGroup();
+int flightJoin(FlightGroup *group, const char *key, void *result, size_t size, FlightCall **call);
+void flightFinish(FlightGroup *group, FlightCall *call, const void *result, size_t size);
+
+#endif // FLIGHT_H
@@ -56,6 +56,12 @@
 // Include LRU and ES headers
 #include "t.h"
 #include "l.h"
+#include "ring.h"
+#include "route.h"
+#include "rate.h"
+#include "sched.h"
+#include "flight.h"
+#include "cap.h"
 
 #define BUFFER_SIZE 4099
 
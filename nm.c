@@ -49,13 +49,22 @@ void log_message(const char *format, ...)
     return;
 }
 
+// Read an integer tunable from the environment, falling back to a default
+int env_int(const char *name, int fallback)
+{
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return fallback;
+    return atoi(value);
+}
+
 #define MAX_PENDING_LOCKS 20000
 #define MAX_PENDING 20000
 #define MAX_PATH_LEN 50000
 #define MAX_STORAGE_SERVERS 500
 
 char *nm_ip;
-int ss_fd, ss_fd1;
+int ss_fd1;
 
 typedef struct
 {
@@ -63,6 +72,7 @@ typedef struct
     char src_path[256];
     char dest_path[256];
     char data[1024];
+    Capability cap; // Unused on naming server requests, storage servers only check it for client data ops
 
 } Request;
 
@@ -78,8 +88,44 @@ typedef struct
     char ip[INET_ADDRSTRLEN]; // IP address of the storage server
     int ss_port;              // Storage server port
     int server_index;         // Index of the storage server
+    char chain[256];          // "ip:port,ip:port" of the downstream replicas a WRITE is forwarded to
+    Capability cap;           // Signed grant the client presents to the storage server, zero when CAP_KEY is unset
 } ServerInfo;
 
+typedef struct
+{
+    int count;  // Entries in this page
+    int more;   // 1 if entries remain after the last one, which is the cursor for the next page
+    int length; // Bytes of "<server index> <path>\n" lines following this header
+} ListPage;
+
+#define LIST_PAGE_DEFAULT 100
+#define LIST_PAGE_MAX 1000
+
+typedef struct
+{
+    char kind; // 'U' metadata valid, 'D' no such path, 'E' storage server could not be asked, 'L' see drop_lagging_replicas
+    char path[256];
+    long long size;
+    int mode;
+    long long atime;
+    long long mtime;
+    long long ctime;
+} MetaRecord;
+
+typedef struct
+{
+    char path[256]; // Path (and everything under it) whose location changed, "" for every path
+} Invalidation;
+
+#define MAX_SUBSCRIBERS 1024
+int subscribers[MAX_SUBSCRIBERS]; // Client connections that asked for location invalidations (SUBSCRIBE)
+int subscriber_count = 0;
+pthread_mutex_t subscriber_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define STAT_MAX_PATHS 64 // Paths answered by one STAT
+#define NM_THROTTLED -3   // Marker replacing a server index or count when a request was rate limited
+
 typedef struct
 {
     char ip[INET_ADDRSTRLEN];
@@ -97,10 +143,51 @@ int smallest_org = INT_MAX;
 
 StorageServerInfo ss_info[MAX_STORAGE_SERVERS];
 int c_ss = 0; // Track the number of storage servers
+int ss_alive[MAX_STORAGE_SERVERS]; // 1 while the storage server's registration connection is up
+int ss_outstanding[MAX_STORAGE_SERVERS]; // READ/STREAM hand-outs not yet acknowledged by the client
+pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER; // Guards ss_outstanding
+
+#define DEFAULT_REPLICATION_FACTOR 2
+int replication_factor = DEFAULT_REPLICATION_FACTOR; // Number of storage servers each created path is placed on
+
+#define PLACEMENT_MANUAL 0 // CREATE goes to the storage server the client picked
+#define PLACEMENT_HASH 1   // CREATE and rebalancing follow a consistent hash ring
+int placement_mode = PLACEMENT_MANUAL; // NM_PLACEMENT=hash selects the ring
+int placement_by_parent = 1;           // NM_PLACEMENT_KEY=path hashes the full path instead of its directory
+HashRing *placement_ring;
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER; // Guards placement_ring
+
+int rebalance_pending = 0; // Set when the ring changed and paths may need to move
+pthread_mutex_t rebalance_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t rebalance_cond = PTHREAD_COND_INITIALIZER;
+
+#define PATH_ACTIVITY_STRIPES 256
+// WRITEs handed out and not yet acknowledged, and migrations in progress, counted per stripe of the path hash
+typedef struct
+{
+    int writers;
+    int migrating;
+} PathActivity;
+PathActivity path_activity[PATH_ACTIVITY_STRIPES];
+pthread_mutex_t activity_lock = PTHREAD_MUTEX_INITIALIZER; // Guards path_activity
+pthread_cond_t activity_cond = PTHREAD_COND_INITIALIZER;
+
+RateLimiter *rate_limiter; // NULL unless NM_RATE_CLIENT or NM_RATE_GLOBAL is set
+
+char *cap_key;              // CAP_KEY: secret shared with the storage servers, NULL disables capabilities
+int cap_ttl = DEFAULT_CAP_TTL; // NM_CAP_TTL: seconds a handed out capability stays valid
+
+Scheduler *scheduler; // Weighted fair dispatch of client requests, NULL when NM_SCHED_SLOTS=0
+#define DEFAULT_SCHED_SLOTS 16
+
+RouteTable routes; // NM_ROUTES: path-prefix shards of the naming service, empty when this server owns everything
 
 NamingServerInfo naming_server;
 TrieNode *path_trie; // Global trie root for path storage
 LRUCache *path_cache;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER; // Guards path_cache, path_trie and ss_info[].file_paths
+FlightGroup *lookup_flights; // Coalesces concurrent cache misses on the same path
+FlightGroup *meta_flights;   // Coalesces concurrent metadata fetches from the storage servers
 
 int yactive_reads = 0;
 
@@ -167,6 +254,13 @@ void *ss_listener(void *args);
 void *handle_client_request(void *client_socket);
 void *handle_ss_registration(void *ss_socket);
 void initialize_naming_server(int client_port, int ss_port);
+void ring_server_joined(int index);
+void ring_server_left(int index);
+void request_rebalance();
+void *rebalance_worker(void *args);
+void apply_meta_record(const MetaRecord *record);
+void drop_lagging_replicas(int head, MetaRecord *record);
+void push_invalidation(const char *path);
 
 int main(int argc, char *argv[])
 {
@@ -244,6 +338,65 @@ void initialize_naming_server(int client_port, int ss_port)
     path_trie = createTrieNode(); // Initialize the trie
 
     path_cache = createLRUCache(90);
+    lookup_flights = createFlightGroup();
+    meta_flights = createFlightGroup();
+
+    srand(time(NULL));
+
+    replication_factor = env_int("NM_REPLICAS", DEFAULT_REPLICATION_FACTOR);
+    if (replication_factor < 1)
+        replication_factor = 1;
+    if (replication_factor > MAX_REPLICAS)
+        replication_factor = MAX_REPLICAS;
+
+    const char *placement = getenv("NM_PLACEMENT");
+    if (placement != NULL && strcmp(placement, "hash") == 0)
+    {
+        const char *key = getenv("NM_PLACEMENT_KEY");
+        placement_by_parent = !(key != NULL && strcmp(key, "path") == 0);
+        placement_mode = PLACEMENT_HASH;
+        placement_ring = createHashRing();
+
+        pthread_t rebalance_thread;
+        if (pthread_create(&rebalance_thread, NULL, rebalance_worker, NULL) == 0)
+            pthread_detach(rebalance_thread);
+        else
+            perror("Failed to create rebalance thread");
+        log_message("Consistent hash placement enabled (%d virtual nodes per server, keyed by %s)\n", RING_VNODES, placement_by_parent ? "parent directory" : "path");
+    }
+
+    int client_rate = env_int("NM_RATE_CLIENT", 0);
+    int global_rate = env_int("NM_RATE_GLOBAL", 0);
+    if (client_rate > 0 || global_rate > 0)
+    {
+        rate_limiter = createRateLimiter(client_rate, env_int("NM_BURST_CLIENT", 0), global_rate, env_int("NM_BURST_GLOBAL", 0));
+        log_message("Rate limiting: %d requests/s per client, %d requests/s overall (0 = unlimited)\n", client_rate, global_rate);
+    }
+
+    if (getenv("CAP_KEY") != NULL && getenv("CAP_KEY")[0] != '\0')
+    {
+        cap_key = strdup(getenv("CAP_KEY"));
+        cap_ttl = env_int("NM_CAP_TTL", DEFAULT_CAP_TTL);
+        log_message("Issuing capabilities valid for %d seconds\n", cap_ttl);
+    }
+
+    int sched_slots = env_int("NM_SCHED_SLOTS", DEFAULT_SCHED_SLOTS);
+    if (sched_slots > 0)
+    {
+        int weights[SCHED_CLASSES] = {env_int("NM_WEIGHT_LOOKUP", 8), env_int("NM_WEIGHT_MUTATION", 4), env_int("NM_WEIGHT_BULK", 1)};
+        // Mutations leave a slot for lookups, tree operations get at most a quarter of the slots
+        int limits[SCHED_CLASSES] = {sched_slots, sched_slots > 1 ? sched_slots - 1 : 1, sched_slots >= 4 ? sched_slots / 4 : 1};
+        scheduler = createScheduler(sched_slots, weights, limits);
+        log_message("Scheduler: %d slots, weights lookup %d mutation %d bulk %d\n", sched_slots, weights[0], weights[1], weights[2]);
+    }
+
+    const char *route_spec = getenv("NM_ROUTES");
+    if (route_spec != NULL && parseRoutes(&routes, route_spec) > 0)
+    {
+        for (int i = 0; i < routes.count; i++)
+            log_message("Shard %s -> %s:%d%s\n", routes.entries[i].prefix, routes.entries[i].ip, routes.entries[i].port,
+                        routeIsSelf(&routes.entries[i], nm_ip, client_port) ? " (this server)" : "");
+    }
 
     printf("Naming Server initialized with IP: %s , Client Port: %d, Storage Server Port: %d\n", nm_ip, naming_server.client_port, naming_server.ss_port);
 
@@ -340,7 +493,9 @@ void *ss_listener(void *args)
             printf("New storage server connected from IP: %s \n",
                    inet_ntoa(ss_addr.sin_addr));
             pthread_t ss_thread;
-            pthread_create(&ss_thread, NULL, handle_ss_registration, (void *)&new_ss);
+            int *ss_socket = malloc(sizeof(int));
+            *ss_socket = new_ss;
+            pthread_create(&ss_thread, NULL, handle_ss_registration, (void *)ss_socket);
             pthread_detach(ss_thread); // Detach thread to handle multiple clients concurrently
         }
         else
@@ -355,10 +510,12 @@ void *ss_listener(void *args)
 
 void *handle_ss_registration(void *ss_socket)
 {
-    ss_fd = *(int *)ss_socket;
+    int ss_fd = *(int *)ss_socket;
+    free(ss_socket);
     StorageServerInfo new_ss_info;
+    int index = -1;
 
-    if (recv(ss_fd, &new_ss_info, sizeof(StorageServerInfo), 0) >= 0)
+    if (recv(ss_fd, &new_ss_info, sizeof(StorageServerInfo), MSG_WAITALL) >= 0)
     {
         if (c_ss < MAX_STORAGE_SERVERS)
         {
@@ -369,13 +526,22 @@ void *handle_ss_registration(void *ss_socket)
             {
                 for (int i = 0; i < c_ss; i++)
                 {
-                    if (strcmp(new_ss_info.file_paths, ss_info[i].file_paths) == 0)
+                    pthread_mutex_lock(&cache_lock);
+                    int known = strcmp(new_ss_info.file_paths, ss_info[i].file_paths) == 0;
+                    pthread_mutex_unlock(&cache_lock);
+                    if (known)
                     {
                         printf("SS %d came back\n", i);
+                        index = i;
+                        ss_alive[i] = 1;
+                        push_invalidation(""); // Reads can be spread over this server again
+                        log_message("Storage server %d is alive again\n", i);
+                        ring_server_joined(i);
                         goto cc4;
                     }
                 }
             }
+            pthread_mutex_lock(&cache_lock);
             ss_info[c_ss] = new_ss_info;
             printf("Registered storage server with IP: %s, Port: %d, %d    %s   \n", new_ss_info.ip, new_ss_info.ss_port, new_ss_info.extra_ss_port, new_ss_info.file_path_org);
             log_message("Registered storage server with IP: %s, Port: %d, %d    %s   \n", new_ss_info.ip, new_ss_info.ss_port, new_ss_info.extra_ss_port, new_ss_info.file_path_org);
@@ -392,15 +558,20 @@ void *handle_ss_registration(void *ss_socket)
                 path = strtok(NULL, ",");
             }
 
+            index = c_ss;
+            ss_alive[index] = 1;
             c_ss++;
             printTrie(path_trie);
+            pthread_mutex_unlock(&cache_lock);
+            ring_server_joined(index);
         }
     }
 cc4:
     while (1)
     {
-        char buffer[1024];
-        int bytes_received = recv(ss_fd, buffer, sizeof(buffer), 0);
+        // The storage server pushes a MetaRecord whenever one of its paths changes
+        MetaRecord record;
+        int bytes_received = recv(ss_fd, &record, sizeof(record), MSG_WAITALL);
         if (bytes_received == 0)
         {
             // Connection lost
@@ -418,12 +589,25 @@ cc4:
             log_message("Connection lost with storage server %s\n", new_ss_info.ip);
             break;
         }
-        else
+        else if (bytes_received == sizeof(record))
         {
-            continue;
+            record.path[sizeof(record.path) - 1] = '\0';
+            if (record.kind == 'L')
+                drop_lagging_replicas(index, &record);
+            else
+                apply_meta_record(&record);
         }
     }
 
+    // Reads and writes for its paths now fail over to the other replicas
+    if (index != -1)
+    {
+        ss_alive[index] = 0;
+        push_invalidation(""); // Clients must stop going to it directly
+        log_message("Storage server %d marked down\n", index);
+        ring_server_left(index);
+    }
+
     // Cleanup after connection loss or error
     close(ss_fd);
     pthread_exit(NULL);
@@ -431,8 +615,44 @@ cc4:
     // close(ss_f);
 }
 
-void change_ss(int index, const char *path, const char *operation)
+void remove_subscriber(int fd)
 {
+    pthread_mutex_lock(&subscriber_lock);
+    for (int i = 0; i < subscriber_count; i++)
+    {
+        if (subscribers[i] == fd)
+        {
+            subscribers[i] = subscribers[--subscriber_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&subscriber_lock);
+}
+
+// Tell every subscribed client to drop cached locations for path; "" drops them all
+void push_invalidation(const char *path)
+{
+    Invalidation message;
+    memset(&message, 0, sizeof(message));
+    strncpy(message.path, path, sizeof(message.path) - 1);
+
+    pthread_mutex_lock(&subscriber_lock);
+    for (int i = 0; i < subscriber_count; i++)
+    {
+        if (send(subscribers[i], &message, sizeof(message), MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(message))
+        {
+            // A client that cannot keep up is cut off, it stops caching once it sees the connection close
+            shutdown(subscribers[i], SHUT_RDWR);
+            subscribers[i--] = subscribers[--subscriber_count];
+        }
+    }
+    pthread_mutex_unlock(&subscriber_lock);
+}
+
+// change_ss with cache_lock held, returns -1 if nothing changed
+int apply_ss_change(int index, const char *path, const char *operation)
+{
+
     if (strcmp(operation, "CREATE") == 0)
     {
         // Insert the path into the file_paths array of the storage server info
@@ -449,7 +669,7 @@ void change_ss(int index, const char *path, const char *operation)
         if (!file_paths_copy)
         {
             perror("Failed to duplicate file paths");
-            return;
+            return -1;
         }
 
         char *new_file_paths = malloc(MAX_PATH_LEN);
@@ -457,7 +677,7 @@ void change_ss(int index, const char *path, const char *operation)
         {
             perror("Failed to allocate memory for new file paths");
             free(file_paths_copy);
-            return;
+            return -1;
         }
 
         *new_file_paths = '\0'; // Initialize empty string
@@ -486,10 +706,56 @@ void change_ss(int index, const char *path, const char *operation)
         printf("Updated file paths for server index %d\n", index);
         printTrie(path_trie);
     }
+    else if (strcmp(operation, "DROP") == 0)
+    {
+        // Only this server's copy of exactly this path goes away, the other replicas keep it
+        char *file_paths_copy = strdup(ss_info[index].file_paths);
+        char *new_file_paths = malloc(MAX_PATH_LEN);
+        if (!file_paths_copy || !new_file_paths)
+        {
+            perror("Failed to allocate memory for new file paths");
+            free(file_paths_copy);
+            free(new_file_paths);
+            return -1;
+        }
+
+        *new_file_paths = '\0';
+        char *token = strtok(file_paths_copy, ",");
+        while (token)
+        {
+            if (strcmp(token, path) != 0)
+            {
+                if (*new_file_paths != '\0')
+                    strcat(new_file_paths, ",");
+                strcat(new_file_paths, token);
+            }
+            token = strtok(NULL, ",");
+        }
+
+        strncpy(ss_info[index].file_paths, new_file_paths, MAX_PATH_LEN - 1);
+        ss_info[index].file_paths[MAX_PATH_LEN - 1] = '\0';
+        removeTrieReplica(path_trie, path, index);
+
+        free(file_paths_copy);
+        free(new_file_paths);
+        printf("Dropped path %s from server index %d\n", path, index);
+    }
     else
     {
         printf("Invalid operation: %s\n", operation);
+        return -1;
     }
+    return 0;
+}
+
+// Record a path appearing on or leaving a storage server, in the trie and the server's path list
+void change_ss(int index, const char *path, const char *operation)
+{
+    pthread_mutex_lock(&cache_lock);
+    int changed = apply_ss_change(index, path, operation);
+    pthread_mutex_unlock(&cache_lock);
+    if (changed == 0)
+        push_invalidation(path); // Clients caching this path's location ask us again
 }
 
 char *gather_all_paths()
@@ -505,6 +771,7 @@ char *gather_all_paths()
     all_paths[0] = '\0'; // Initialize the string as empty
 
     // Iterate through all the storage servers and concatenate their paths
+    pthread_mutex_lock(&cache_lock);
     for (int i = 0; i < c_ss; i++)
     {
         // Add the label for this storage server
@@ -526,6 +793,7 @@ char *gather_all_paths()
 
         strcat(all_paths, "\n"); // Add a newline after each server's paths
     }
+    pthread_mutex_unlock(&cache_lock);
 
     return all_paths; // Return the dynamically allocated string
 }
@@ -556,13 +824,755 @@ void send_paths_to_client(int client_fd, char *all_paths)
     }
 }
 
+// Resolve a path to its storage server through the LRU cache, falling back to the trie.
+// Concurrent misses on one path share a single trie walk and cache insert
+int lookup_server_index(const char *path)
+{
+    pthread_mutex_lock(&cache_lock);
+    int server_index = scn(path_cache, path);
+    pthread_mutex_unlock(&cache_lock);
+    if (server_index != -1)
+    {
+        printf("Cache Hit\n");
+        return server_index;
+    }
+
+    FlightCall *call;
+    if (!flightJoin(lookup_flights, path, &server_index, sizeof(server_index), &call))
+        return server_index;
+
+    pthread_mutex_lock(&cache_lock);
+    server_index = searchTrie(path_trie, path);
+    if (server_index != -1)
+        insert(path_cache, path, server_index);
+    pthread_mutex_unlock(&cache_lock);
+
+    flightFinish(lookup_flights, call, &server_index, sizeof(server_index));
+    return server_index;
+}
+
+void forget_cached_path(const char *path)
+{
+    pthread_mutex_lock(&cache_lock);
+    deleteCh(path_cache, path);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Copy out the path's replica chain, trie changes may free it once the lock is dropped
+int path_replicas(const char *path, int *out, int max)
+{
+    pthread_mutex_lock(&cache_lock);
+    int count = getTrieReplicas(path_trie, path, out, max);
+    pthread_mutex_unlock(&cache_lock);
+    return count;
+}
+
+// Return the first live member of the path's replica chain, or -1 if every replica is down
+int pick_live_replica(const char *path, int server_index)
+{
+    int chain[MAX_REPLICAS];
+    int count = path_replicas(path, chain, MAX_REPLICAS);
+    if (count == 0)
+        return server_index; // Directory prefixes carry no chain of their own
+
+    for (int i = 0; i < count; i++)
+    {
+        if (ss_alive[chain[i]])
+        {
+            if (chain[i] != server_index)
+                log_message("Storage server %d is down, failing over %s to %d\n", server_index, path, chain[i]);
+            return chain[i];
+        }
+    }
+    log_message("No live replica for %s\n", path);
+    return -1;
+}
+
+// Proximity hint for a storage server as seen from a client: 2 on the same host, 1 on the same /24, else 0
+int proximity(int index, struct in_addr client_addr)
+{
+    struct in_addr ss_addr;
+    if (inet_pton(AF_INET, ss_info[index].ip, &ss_addr) <= 0)
+        return 0;
+    if (ss_addr.s_addr == client_addr.s_addr)
+        return 2;
+    if ((ntohl(ss_addr.s_addr) & 0xFFFFFF00) == (ntohl(client_addr.s_addr) & 0xFFFFFF00))
+        return 1;
+    return 0;
+}
+
+// Spread READ/STREAM over the live replicas: power of two choices on outstanding requests,
+// with nearby servers counting as slightly less loaded
+int pick_read_replica(const char *path, int server_index, struct in_addr client_addr)
+{
+    int chain[MAX_REPLICAS];
+    int count = path_replicas(path, chain, MAX_REPLICAS);
+    int live[MAX_REPLICAS];
+    int live_count = 0;
+
+    for (int i = 0; i < count; i++)
+        if (ss_alive[chain[i]])
+            live[live_count++] = chain[i];
+
+    if (live_count <= 1)
+        return pick_live_replica(path, server_index);
+
+    // Two distinct random candidates
+    int first = rand() % live_count;
+    int second = rand() % (live_count - 1);
+    if (second >= first)
+        second++;
+    int a = live[first];
+    int b = live[second];
+
+    pthread_mutex_lock(&load_lock);
+    int score_a = 2 * ss_outstanding[a] - proximity(a, client_addr);
+    int score_b = 2 * ss_outstanding[b] - proximity(b, client_addr);
+    pthread_mutex_unlock(&load_lock);
+
+    return score_b < score_a ? b : a;
+}
+
+void acquire_read_load(int index)
+{
+    pthread_mutex_lock(&load_lock);
+    ss_outstanding[index]++;
+    pthread_mutex_unlock(&load_lock);
+}
+
+void release_read_load(int index)
+{
+    pthread_mutex_lock(&load_lock);
+    if (ss_outstanding[index] > 0)
+        ss_outstanding[index]--;
+    pthread_mutex_unlock(&load_lock);
+}
+
+// Fill server_info->chain with the live replicas after head, in chain order
+void build_write_chain(const char *path, int head, ServerInfo *server_info)
+{
+    int chain[MAX_REPLICAS];
+    int count = path_replicas(path, chain, MAX_REPLICAS);
+    server_info->chain[0] = '\0';
+
+    // The client passes the chain on in a Request's dest_path: a hop that would not fit whole is left out
+    // instead of being cut off mid-address
+    size_t room = sizeof(((Request *)0)->dest_path);
+    if (room > sizeof(server_info->chain))
+        room = sizeof(server_info->chain);
+    for (int i = 0; i < count; i++)
+    {
+        if (chain[i] == head || !ss_alive[chain[i]])
+            continue;
+        char hop[64];
+        snprintf(hop, sizeof(hop), "%s%s:%d", server_info->chain[0] ? "," : "", ss_info[chain[i]].ip, ss_info[chain[i]].cl_port);
+        if (strlen(server_info->chain) + strlen(hop) >= room)
+        {
+            log_message("Replica chain of %s is full, storage server %d left out\n", path, chain[i]);
+            break;
+        }
+        strcat(server_info->chain, hop);
+    }
+}
+
+// Connect to a storage server's naming port and send a request (and an optional int argument), -1 on failure
+int ss_send_request(int index, const char *function, const char *src_path, const char *dest_path, const int *arg)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_in ss_addr;
+    memset(&ss_addr, 0, sizeof(ss_addr));
+    ss_addr.sin_family = AF_INET;
+    ss_addr.sin_port = htons(ss_info[index].extra_ss_port);
+    if (inet_pton(AF_INET, ss_info[index].ip, &ss_addr.sin_addr) <= 0 ||
+        connect(fd, (struct sockaddr *)&ss_addr, sizeof(ss_addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    Request request;
+    memset(&request, 0, sizeof(request));
+    strncpy(request.function, function, sizeof(request.function) - 1);
+    strncpy(request.src_path, src_path, sizeof(request.src_path) - 1);
+    if (dest_path != NULL)
+        strncpy(request.dest_path, dest_path, sizeof(request.dest_path) - 1);
+
+    if (send(fd, &request, sizeof(Request), 0) == -1 || (arg != NULL && send(fd, arg, sizeof(int), 0) == -1))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send a request to a storage server's naming port and collect its ack
+int ss_request(int index, const char *function, const char *src_path, const char *dest_path, const int *arg, char *ack, size_t ack_size)
+{
+    int fd = ss_send_request(index, function, src_path, dest_path, arg);
+    if (fd < 0)
+        return -1;
+
+    int ack_len = recv(fd, ack, ack_size - 1, 0);
+    if (ack_len >= 0)
+        ack[ack_len] = '\0';
+    close(fd);
+    return ack_len;
+}
+
+// The shard owning a path when it is another naming server, NULL when we own it (or the service is not sharded)
+const RouteEntry *foreign_route(const char *path)
+{
+    if (routes.count == 0 || path == NULL)
+        return NULL;
+    const RouteEntry *route = routeLookup(&routes, path);
+    if (route == NULL || routeIsSelf(route, nm_ip, naming_server.client_port))
+        return NULL;
+    return route;
+}
+
+// Point the client at the shard owning the path, in whatever reply format the operation normally uses
+void send_redirect(int client_fd, const char *operation, const RouteEntry *route)
+{
+    log_message("Redirecting %s to naming server %s:%d (shard %s)\n", operation, route->ip, route->port, route->prefix);
+    if (strcmp(operation, "READ") == 0 || strcmp(operation, "WRITE") == 0 || strcmp(operation, "STREAM") == 0)
+    {
+        ServerInfo server_info;
+        memset(&server_info, 0, sizeof(server_info));
+        snprintf(server_info.ip, sizeof(server_info.ip), "%s", route->ip);
+        server_info.ss_port = route->port;
+        server_info.server_index = ROUTE_REDIRECT;
+        send(client_fd, &server_info, sizeof(server_info), 0);
+    }
+    else if (strcmp(operation, "GET_INFO") == 0 || strcmp(operation, "STAT") == 0)
+    {
+        int count = ROUTE_REDIRECT;
+        send(client_fd, &count, sizeof(int), 0);
+    }
+    else if (strcmp(operation, "LIST") == 0)
+    {
+        ListPage header = {ROUTE_REDIRECT, 0, 0};
+        send(client_fd, &header, sizeof(header), 0);
+    }
+    else
+    {
+        if (strcmp(operation, "CREATE") == 0)
+        {
+            // The client sends the file/folder choice and server index without waiting, drain them
+            int ignored[2];
+            recv(client_fd, ignored, sizeof(ignored), MSG_WAITALL);
+        }
+        char reply[64];
+        snprintf(reply, sizeof(reply), "REDIRECT %s:%d", route->ip, route->port);
+        send(client_fd, reply, strlen(reply), 0);
+    }
+}
+
+// Sign a capability for the client to present to the storage server with its data operation. A WRITE's
+// replica chain is signed into it, so the storage servers only forward the write where we said
+void grant_capability(ServerInfo *server_info, const char *path, int ops)
+{
+    if (cap_key != NULL)
+        capSign(&server_info->cap, cap_key, path, ops, (long long)time(NULL) + cap_ttl, server_info->chain);
+}
+
+// Scheduling class of a client command, -1 for commands that bypass the queues
+int sched_class_of(const char *operation)
+{
+    if (strcmp(operation, "READ") == 0 || strcmp(operation, "STREAM") == 0 || strcmp(operation, "GET_INFO") == 0 ||
+        strcmp(operation, "STAT") == 0 || strcmp(operation, "LIST") == 0)
+        return SCHED_LOOKUP;
+    if (strcmp(operation, "WRITE") == 0 || strcmp(operation, "CREATE") == 0)
+        return SCHED_MUTATION;
+    if (strcmp(operation, "DELETE") == 0 || strcmp(operation, "COPY") == 0)
+        return SCHED_BULK;
+    return -1;
+}
+
+// Refuse a throttled command in the reply format the operation normally uses, carrying the retry delay
+void send_throttled(int client_fd, const char *operation, int retry_ms)
+{
+    if (strcmp(operation, "READ") == 0 || strcmp(operation, "WRITE") == 0 || strcmp(operation, "STREAM") == 0)
+    {
+        ServerInfo server_info;
+        memset(&server_info, 0, sizeof(server_info));
+        server_info.ss_port = retry_ms;
+        server_info.server_index = NM_THROTTLED;
+        send(client_fd, &server_info, sizeof(server_info), 0);
+    }
+    else if (strcmp(operation, "GET_INFO") == 0 || strcmp(operation, "STAT") == 0)
+    {
+        int reply[2] = {NM_THROTTLED, retry_ms};
+        send(client_fd, reply, sizeof(reply), 0);
+    }
+    else if (strcmp(operation, "LIST") == 0)
+    {
+        ListPage header = {NM_THROTTLED, retry_ms, 0};
+        send(client_fd, &header, sizeof(header), 0);
+    }
+    else
+    {
+        if (strcmp(operation, "CREATE") == 0)
+        {
+            int ignored[2];
+            recv(client_fd, ignored, sizeof(ignored), MSG_WAITALL);
+        }
+        char reply[64];
+        snprintf(reply, sizeof(reply), "RETRY_AFTER %d", retry_ms);
+        send(client_fd, reply, strlen(reply), 0);
+    }
+}
+
+// Cache (or drop) a path's metadata as reported by a storage server
+void apply_meta_record(const MetaRecord *record)
+{
+    pthread_mutex_lock(&cache_lock);
+    if (record->kind == 'U')
+    {
+        PathMeta meta = {record->size, record->mode, record->atime, record->mtime, record->ctime};
+        setTrieMeta(path_trie, record->path, &meta);
+    }
+    else
+    {
+        setTrieMeta(path_trie, record->path, NULL);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// A chain head could not pass a write on to the rest of the chain, so only its copy of the path is current: the
+// other replicas stop serving it, and with hash placement the rebalancer copies it back to them
+void drop_lagging_replicas(int head, MetaRecord *record)
+{
+    int chain[MAX_REPLICAS];
+    int count = path_replicas(record->path, chain, MAX_REPLICAS);
+    int held = 0;
+    for (int c = 0; c < count; c++)
+        if (chain[c] == head)
+            held = 1;
+    if (!held)
+        return;
+
+    for (int c = 0; c < count; c++)
+        if (chain[c] != head)
+            change_ss(chain[c], record->path, "DROP");
+    record->kind = 'U';
+    apply_meta_record(record);
+    forget_cached_path(record->path);
+    log_message("Write to %s did not reach its replicas, only storage server %d keeps it\n", record->path, head);
+    if (placement_mode == PLACEMENT_HASH)
+        request_rebalance();
+}
+
+// Metadata for GET_INFO/STAT: served from the trie, a miss asks a live replica once and caches the answer
+void lookup_path_meta(const char *path, MetaRecord *record)
+{
+    memset(record, 0, sizeof(MetaRecord));
+    strncpy(record->path, path, sizeof(record->path) - 1);
+
+    PathMeta meta;
+    pthread_mutex_lock(&cache_lock);
+    int hit = getTrieMeta(path_trie, path, &meta);
+    pthread_mutex_unlock(&cache_lock);
+    if (hit)
+    {
+        record->kind = 'U';
+        record->size = meta.size;
+        record->mode = meta.mode;
+        record->atime = meta.atime;
+        record->mtime = meta.mtime;
+        record->ctime = meta.ctime;
+        return;
+    }
+
+    // A herd of misses on one path costs a single storage server round trip
+    FlightCall *call;
+    if (!flightJoin(meta_flights, path, record, sizeof(MetaRecord), &call))
+        return;
+
+    int server_index = lookup_server_index(path);
+    if (server_index != -1)
+        server_index = pick_live_replica(path, server_index);
+    if (server_index == -1)
+    {
+        record->kind = 'D';
+        flightFinish(meta_flights, call, record, sizeof(MetaRecord));
+        return;
+    }
+
+    record->kind = 'E';
+    int fd = ss_send_request(server_index, "STAT", path, NULL, NULL);
+    if (fd >= 0)
+    {
+        MetaRecord fetched;
+        if (recv(fd, &fetched, sizeof(fetched), MSG_WAITALL) == sizeof(fetched))
+        {
+            fetched.path[sizeof(fetched.path) - 1] = '\0';
+            *record = fetched;
+            strncpy(record->path, path, sizeof(record->path) - 1);
+            apply_meta_record(record);
+            log_message("Metadata miss for %s, fetched from storage server %d\n", path, server_index);
+        }
+        close(fd);
+    }
+    flightFinish(meta_flights, call, record, sizeof(MetaRecord));
+}
+
+// The ring key of a path: its parent directory (so a directory's files stay together) or the path itself
+void placement_key(const char *path, char *key, size_t key_size)
+{
+    strncpy(key, path, key_size - 1);
+    key[key_size - 1] = '\0';
+    char *slash = strrchr(key, '/');
+    if (placement_by_parent && slash != NULL && slash != key)
+        *slash = '\0';
+}
+
+// Storage server that should own a path under hash placement, -1 if the ring is empty
+int placement_owner(const char *path)
+{
+    char key[1024];
+    placement_key(path, key, sizeof(key));
+    pthread_mutex_lock(&ring_lock);
+    int owner = ringLookup(placement_ring, key);
+    pthread_mutex_unlock(&ring_lock);
+    return owner;
+}
+
+// Servers that should hold a path, primary first: successive ring owners, or the next live indexes
+int placement_targets(const char *path, int primary, int *out, int max)
+{
+    int count = 0;
+    if (max > replication_factor)
+        max = replication_factor;
+
+    if (placement_mode == PLACEMENT_HASH)
+    {
+        char key[1024];
+        placement_key(path, key, sizeof(key));
+        pthread_mutex_lock(&ring_lock);
+        count = ringLookupReplicas(placement_ring, key, out, max);
+        pthread_mutex_unlock(&ring_lock);
+        if (count > 0)
+            return count;
+    }
+
+    out[count++] = primary;
+    for (int step = 1; step < c_ss && count < max; step++)
+    {
+        int index = (primary + step) % c_ss;
+        if (ss_alive[index])
+            out[count++] = index;
+    }
+    return count;
+}
+
+// Create the path on the rest of its placement targets until the replica set is complete
+void replicate_create(int primary, const char *path, int kind)
+{
+    int targets[MAX_REPLICAS];
+    int count = placement_targets(path, primary, targets, MAX_REPLICAS);
+    for (int t = 0; t < count; t++)
+    {
+        int index = targets[t];
+        if (index == primary || !ss_alive[index])
+            continue;
+
+        char ack[1024];
+        if (ss_request(index, "CREATE", path, NULL, &kind, ack, sizeof(ack)) > 0 && strstr(ack, "success") != NULL)
+        {
+            change_ss(index, path, "CREATE");
+            log_message("Replicated %s on storage server %d\n", path, index);
+        }
+        else
+        {
+            log_message("Could not replicate %s on storage server %d\n", path, index);
+        }
+    }
+}
+
+void ring_server_joined(int index)
+{
+    if (placement_mode != PLACEMENT_HASH)
+        return;
+    char label[64];
+    snprintf(label, sizeof(label), "%s:%d", ss_info[index].ip, ss_info[index].cl_port);
+    pthread_mutex_lock(&ring_lock);
+    ringAddServer(placement_ring, index, label);
+    pthread_mutex_unlock(&ring_lock);
+    request_rebalance();
+}
+
+void ring_server_left(int index)
+{
+    if (placement_mode != PLACEMENT_HASH)
+        return;
+    pthread_mutex_lock(&ring_lock);
+    ringRemoveServer(placement_ring, index);
+    pthread_mutex_unlock(&ring_lock);
+    request_rebalance();
+}
+
+void request_rebalance()
+{
+    pthread_mutex_lock(&rebalance_lock);
+    rebalance_pending = 1;
+    pthread_cond_signal(&rebalance_cond);
+    pthread_mutex_unlock(&rebalance_lock);
+}
+
+PathActivity *path_activity_for(const char *path)
+{
+    unsigned long hash = 5381;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++)
+        hash = hash * 33 + *p;
+    return &path_activity[hash % PATH_ACTIVITY_STRIPES];
+}
+
+// A WRITE of path is about to be handed out: wait for a migration of it to finish first
+void begin_path_write(const char *path)
+{
+    PathActivity *activity = path_activity_for(path);
+    pthread_mutex_lock(&activity_lock);
+    while (activity->migrating > 0)
+        pthread_cond_wait(&activity_cond, &activity_lock);
+    activity->writers++;
+    pthread_mutex_unlock(&activity_lock);
+}
+
+void end_path_write(const char *path)
+{
+    PathActivity *activity = path_activity_for(path);
+    pthread_mutex_lock(&activity_lock);
+    activity->writers--;
+    pthread_cond_broadcast(&activity_cond);
+    pthread_mutex_unlock(&activity_lock);
+}
+
+// Claim path for a migration, returns 0 while a WRITE of it is outstanding so a copy cannot miss that write
+int begin_path_migration(const char *path)
+{
+    PathActivity *activity = path_activity_for(path);
+    pthread_mutex_lock(&activity_lock);
+    int claimed = activity->writers == 0;
+    if (claimed)
+        activity->migrating++;
+    pthread_mutex_unlock(&activity_lock);
+    return claimed;
+}
+
+void end_path_migration(const char *path)
+{
+    PathActivity *activity = path_activity_for(path);
+    pthread_mutex_lock(&activity_lock);
+    activity->migrating--;
+    pthread_cond_broadcast(&activity_cond);
+    pthread_mutex_unlock(&activity_lock);
+}
+
+typedef struct
+{
+    char **paths;
+    int *is_dir; // 1 when other paths live beneath this one
+    int count;
+    int capacity;
+} PathList;
+
+void collect_trie_path(const char *path, TrieNode *node, void *arg)
+{
+    PathList *list = (PathList *)arg;
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+        if (paths == NULL)
+            return;
+        list->paths = paths;
+        int *is_dir = realloc(list->is_dir, capacity * sizeof(int));
+        if (is_dir == NULL)
+            return;
+        list->is_dir = is_dir;
+        list->capacity = capacity;
+    }
+    list->is_dir[list->count] = node->children['/'] != NULL;
+    list->paths[list->count++] = strdup(path);
+}
+
+// Copy path from one storage server to another (the destination pulls it), returns 0 on success
+int migrate_path(const char *path, int from, int to)
+{
+    char source[64];
+    char ack[256];
+    snprintf(source, sizeof(source), "%s:%d", ss_info[from].ip, ss_info[from].extra_ss_port);
+    if (ss_request(to, "PULL", path, source, NULL, ack, sizeof(ack)) <= 0 || strstr(ack, "success") == NULL)
+    {
+        log_message("Migration of %s from storage server %d to %d failed\n", path, from, to);
+        return -1;
+    }
+    change_ss(to, path, "CREATE");
+    return 0;
+}
+
+// Bring one path's replica chain in line with the ring, returns 1 if anything moved
+int rebalance_path(const char *path, int is_dir)
+{
+    int chain[MAX_REPLICAS], desired[MAX_REPLICAS];
+    int chain_count = path_replicas(path, chain, MAX_REPLICAS);
+    if (chain_count == 0)
+        return 0;
+
+    char key[1024];
+    placement_key(path, key, sizeof(key));
+    pthread_mutex_lock(&ring_lock);
+    int desired_count = ringLookupReplicas(placement_ring, key, desired, replication_factor);
+    pthread_mutex_unlock(&ring_lock);
+    if (desired_count == 0)
+        return 0;
+
+    int source = -1;
+    for (int i = 0; i < chain_count && source == -1; i++)
+        if (ss_alive[chain[i]])
+            source = chain[i];
+    if (source == -1)
+        return 0; // Nothing live to copy from, retry when a replica comes back
+
+    int moved = 0, complete = 1;
+    for (int d = 0; d < desired_count; d++)
+    {
+        int held = 0;
+        for (int c = 0; c < chain_count; c++)
+            if (chain[c] == desired[d])
+                held = 1;
+        if (held)
+            continue;
+        if (migrate_path(path, source, desired[d]) == 0)
+            moved = 1;
+        else
+            complete = 0;
+    }
+
+    // Only retire old copies once every desired server holds the path; directories are never
+    // removed since the old owner may still hold files placed beneath them
+    for (int c = 0; complete && !is_dir && c < chain_count; c++)
+    {
+        int wanted = 0;
+        for (int d = 0; d < desired_count; d++)
+            if (desired[d] == chain[c])
+                wanted = 1;
+        if (wanted || !ss_alive[chain[c]])
+            continue;
+
+        char ack[256];
+        if (ss_request(chain[c], "DELETE", path, NULL, NULL, ack, sizeof(ack)) > 0 && strstr(ack, "success") != NULL)
+        {
+            change_ss(chain[c], path, "DROP");
+            moved = 1;
+        }
+    }
+
+    if (moved)
+        forget_cached_path(path);
+    return moved;
+}
+
+// Background thread: whenever the ring changes, move the (about 1/N) paths whose owners changed
+void *rebalance_worker(void *args)
+{
+    (void)args;
+    while (1)
+    {
+        pthread_mutex_lock(&rebalance_lock);
+        while (!rebalance_pending)
+            pthread_cond_wait(&rebalance_cond, &rebalance_lock);
+        rebalance_pending = 0;
+        pthread_mutex_unlock(&rebalance_lock);
+
+        PathList list = {NULL, NULL, 0, 0};
+        pthread_mutex_lock(&cache_lock);
+        forEachTriePath(path_trie, collect_trie_path, &list);
+        pthread_mutex_unlock(&cache_lock);
+
+        int moved = 0, busy = 0;
+        for (int i = 0; i < list.count; i++)
+        {
+            if (begin_path_migration(list.paths[i]))
+            {
+                moved += rebalance_path(list.paths[i], list.is_dir[i]);
+                end_path_migration(list.paths[i]);
+            }
+            else
+            {
+                busy++;
+            }
+            free(list.paths[i]);
+        }
+        free(list.paths);
+        free(list.is_dir);
+        log_message("Rebalance moved %d of %d paths, %d busy\n", moved, list.count, busy);
+        if (busy > 0)
+        {
+            // Paths being written are retried once their writes are acknowledged
+            sleep(1);
+            request_rebalance();
+        }
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+    int count;
+    int limit;
+    int more;
+} ListBuffer;
+
+// listTrie callback: append "<server index> <path>\n", the entry past the limit only flags another page
+void append_list_entry(const char *path, int server_index, void *arg)
+{
+    ListBuffer *page = (ListBuffer *)arg;
+    if (page->count == page->limit)
+    {
+        page->more = 1;
+        return;
+    }
+
+    char line[1100];
+    int len = snprintf(line, sizeof(line), "%d %s\n", server_index, path);
+    if (page->length + len > page->capacity)
+    {
+        size_t capacity = page->capacity ? page->capacity * 2 : 4096;
+        while (capacity < page->length + len)
+            capacity *= 2;
+        char *data = realloc(page->data, capacity);
+        if (data == NULL)
+            return;
+        page->data = data;
+        page->capacity = capacity;
+    }
+    memcpy(page->data + page->length, line, len);
+    page->length += len;
+    page->count++;
+}
+
 void *handle_client_request(void *client_socket)
 {
     int client_fd = *(int *)client_socket;
     char client_command[6501];
 
+    // Client address, used as a proximity hint when choosing a replica
+    struct sockaddr_in peer_addr;
+    socklen_t peer_len = sizeof(peer_addr);
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    getpeername(client_fd, (struct sockaddr *)&peer_addr, &peer_len);
+    SchedTicket ticket = {NULL, 0, 0};
+
     while (1)
     {
+        schedLeave(&ticket); // Never hold a slot while waiting for the next command
         int bytes_received = recv(client_fd, client_command, sizeof(client_command), 0);
         if (bytes_received <= 0)
         {
@@ -584,6 +1594,20 @@ void *handle_client_request(void *client_socket)
 
         client_command[bytes_received] = '\0'; // Ensure null-terminated string
 
+        // Admission control before any parsing or trie work; routing, stats, subscriptions and QUIT are never throttled
+        if (rate_limiter != NULL && bytes_received > 2)
+        {
+            char peek[32] = "";
+            sscanf(client_command, "%31s", peek);
+            int retry_ms = 0;
+            if (strcmp(peek, "ROUTES") != 0 && strcmp(peek, "STATS") != 0 && strcmp(peek, "QUIT") != 0 && strcmp(peek, "SUBSCRIBE") != 0 &&
+                !rateAdmit(rate_limiter, peer_addr.sin_addr.s_addr, &retry_ms))
+            {
+                send_throttled(client_fd, peek, retry_ms);
+                continue;
+            }
+        }
+
         {
             printf("Received command from client: %s\n", client_command);
             log_message("Received command from client: %s\n", client_command);
@@ -596,8 +1620,19 @@ void *handle_client_request(void *client_socket)
             char *operation = strtok(client_command, " ");
             // char *path = strtok(NULL, " ");  // Get the full path string (src_path and dest_path)
 
+            // Wait for a slot in the request's class queue, lookups get the largest share
+            int sched_class = sched_class_of(operation);
+            if (sched_class != -1)
+                schedEnter(scheduler, &ticket, sched_class);
+
             if (strcmp(operation, "LIST") == 0)
                 goto cc1;
+            if (strcmp(operation, "ROUTES") == 0)
+                goto cc2;
+            if (strcmp(operation, "STATS") == 0)
+                goto cc3;
+            if (strcmp(operation, "SUBSCRIBE") == 0)
+                goto cc4s;
             if (strcmp(operation, "QUIT") == 0)
                 goto cc10;
 
@@ -625,22 +1660,29 @@ void *handle_client_request(void *client_socket)
             // printf("Integer: %d\n", path_int);
             int server_index;
 
+            // Paths outside our shard belong to another naming server
+            const RouteEntry *owner = foreign_route(src_path);
+            if (owner != NULL)
+            {
+                send_redirect(client_fd, operation, owner);
+                continue;
+            }
+            if (strcmp(operation, "COPY") == 0 && foreign_route(dest_path) != NULL)
+            {
+                log_message("ERROR: COPY across naming server shards\n");
+                send(client_fd, "ERROR: Source and destination are on different naming server shards", strlen("ERROR: Source and destination are on different naming server shards"), 0);
+                continue;
+            }
+
             // Handle the READ, WRITE, STREAM, or GET_INFO operations
             if (strcmp(operation, "READ") == 0)
             {
-                if (scn(path_cache, src_path) == -1)
-                {
-
-                    server_index = searchTrie(path_trie, src_path);
-                    insert(path_cache, src_path, server_index);
-                }
-                else
-                {
-                    printf("Cache Hit\n");
-                    server_index = scn(path_cache, src_path);
-                }
+                server_index = lookup_server_index(src_path);
+                if (server_index != -1)
+                    server_index = pick_read_replica(src_path, server_index, peer_addr.sin_addr);
 
                 ServerInfo server_info;
+                memset(&server_info, 0, sizeof(server_info));
 
                 if (server_index != -1)
                 {
@@ -648,15 +1690,18 @@ void *handle_client_request(void *client_socket)
                     lock_path(server_index); // Lock for cache read
                     yactive_reads++;
                     unlock_path(server_index);
+                    acquire_read_load(server_index);
 
                     strcpy(server_info.ip, ss_info[server_index].ip);    // Copy IP
                     server_info.ss_port = ss_info[server_index].cl_port; // Copy port
                     server_info.server_index = server_index;             // Add server index
+                    grant_capability(&server_info, src_path, CAP_READ);
 
                     // Send the struct to the client
                     if (send(client_fd, &server_info, sizeof(ServerInfo), 0) < 0)
                     {
                         send(client_fd, "ERROR: Failed to send server information", strlen("ERROR: Failed to send server information"), 0);
+                        release_read_load(server_index);
                         lock_path(server_index); // Lock for cache read
                         yactive_reads--;
                         if (yactive_reads == 0)
@@ -667,7 +1712,9 @@ void *handle_client_request(void *client_socket)
                         continue;
                     }
                     char rep[1024];
+                    schedLeave(&ticket); // Done with naming server work, the client ack can take long
                     recv(client_fd, rep, sizeof(rep), 0);
+                    release_read_load(server_index);
                     printf("recieved ack from client %s\n", rep);
                     int p = -1;
                     log_message("recieved ack from client %s\n", rep);
@@ -695,31 +1742,78 @@ void *handle_client_request(void *client_socket)
                     }
                     char rep[256];
 
+                    schedLeave(&ticket);
                     recv(client_fd, rep, sizeof(rep), 0);
                     // printf("recieved ack from client %s\n",rep);
                     printf("%s received from client for %s", rep, operation);
                     log_message("%s received from client for %s", rep, operation);
                 }
             }
-            else if (strcmp(operation, "WRITE") == 0 || strcmp(operation, "STREAM") == 0 || strcmp(operation, "GET_INFO") == 0)
+            else if (strcmp(operation, "GET_INFO") == 0 || strcmp(operation, "STAT") == 0)
             {
-                if (scn(path_cache, src_path) == -1)
+                // Answered from the metadata cache: an int count followed by one MetaRecord per path
+                char *paths[STAT_MAX_PATHS];
+                int count = 0;
+                paths[count++] = src_path;
+                for (char *next = dest_path; next != NULL && count < STAT_MAX_PATHS; next = strtok(NULL, " "))
+                    paths[count++] = next;
+                if (strcmp(operation, "GET_INFO") == 0)
+                    count = 1;
+
+                // Clients split STAT by shard, a path from another shard means their routing table is stale
+                const RouteEntry *stat_owner = NULL;
+                for (int i = 1; i < count && stat_owner == NULL; i++)
+                    stat_owner = foreign_route(paths[i]);
+                if (stat_owner != NULL)
                 {
-
-                    server_index = searchTrie(path_trie, src_path);
-                    insert(path_cache, src_path, server_index);
+                    send_redirect(client_fd, operation, stat_owner);
+                    continue;
                 }
-                else
+
+                MetaRecord *records = malloc(count * sizeof(MetaRecord));
+                if (records == NULL)
                 {
-                    printf("Cache Hit\n");
-                    log_message("Cache Hit\n");
-                    server_index = scn(path_cache, src_path);
+                    int none = 0;
+                    send(client_fd, &none, sizeof(int), 0);
+                    continue;
                 }
+                for (int i = 0; i < count; i++)
+                    lookup_path_meta(paths[i], &records[i]);
+
+                send(client_fd, &count, sizeof(int), 0);
+                send(client_fd, records, count * sizeof(MetaRecord), 0);
+                free(records);
+                log_message("%s answered %d paths\n", operation, count);
+            }
+            else if (strcmp(operation, "WRITE") == 0 || strcmp(operation, "STREAM") == 0)
+            {
+                // Rebalancing leaves the path alone until this WRITE is acknowledged, and a WRITE waits for a
+                // migration in progress so it is handed the chain the migration leaves behind
+                int writing = strcmp(operation, "WRITE") == 0;
+                if (writing)
+                    begin_path_write(src_path);
+                server_index = lookup_server_index(src_path);
+                if (server_index != -1 && strcmp(operation, "STREAM") == 0)
+                    server_index = pick_read_replica(src_path, server_index, peer_addr.sin_addr);
+                else if (server_index != -1)
+                    server_index = pick_live_replica(src_path, server_index);
 
                 ServerInfo server_info;
+                memset(&server_info, 0, sizeof(server_info));
 
                 if (server_index != -1)
                 {
+                    // The first live replica heads the chain, the rest receive the write from it.
+                    // Cached metadata goes stale now, the head's notice refreshes it once the write lands
+                    if (strcmp(operation, "WRITE") == 0)
+                    {
+                        build_write_chain(src_path, server_index, &server_info);
+                        MetaRecord stale;
+                        memset(&stale, 0, sizeof(stale));
+                        stale.kind = 'D';
+                        strncpy(stale.path, src_path, sizeof(stale.path) - 1);
+                        apply_meta_record(&stale);
+                    }
 
                     while (yactive_reads > 0)
                     {
@@ -729,22 +1823,35 @@ void *handle_client_request(void *client_socket)
                     strcpy(server_info.ip, ss_info[server_index].ip);    // Copy IP
                     server_info.ss_port = ss_info[server_index].cl_port; // Copy port
                     server_info.server_index = server_index;             // Add server index
+                    grant_capability(&server_info, src_path, strcmp(operation, "WRITE") == 0 ? CAP_WRITE : CAP_READ);
 
                     // Send the struct to the client
                     if (send(client_fd, &server_info, sizeof(ServerInfo), 0) < 0)
                     {
                         // send(client_fd, "ERROR: Failed to send server information", strlen("ERROR: Failed to send server information"), 0);
                         unlock_path(server_index);
+                        if (writing)
+                            end_path_write(src_path);
                         continue;
                     }
                     if (strcmp(operation, "STREAM") == 0)
+                    {
+                        // The stream counts against the replica until the client reports it finished
+                        acquire_read_load(server_index);
                         unlock_path(server_index);
+                        char rep[1024];
+                        schedLeave(&ticket);
+                        recv(client_fd, rep, sizeof(rep), 0);
+                        release_read_load(server_index);
+                        log_message("%s received from client for %s", rep, operation);
+                    }
 
                     if (strcmp(operation, "STREAM") != 0)
                     {
 
                         char rep[1024];
                         unlock_path(server_index);
+                        schedLeave(&ticket);
                         recv(client_fd, rep, sizeof(rep), 0);
                         int p = -1;
                         // printf("recieved ack from client %s\n",rep);
@@ -789,9 +1896,13 @@ void *handle_client_request(void *client_socket)
                             close(ss_fd1);
                         }
                     }
+                    if (writing)
+                        end_path_write(src_path);
                 }
                 else
                 {
+                    if (writing)
+                        end_path_write(src_path);
                     memset(server_info.ip, 0, sizeof(server_info.ip)); // Copy IP
                     server_info.ss_port = -1;                          // Copy port
                     server_info.server_index = -1;                     // Add server index
@@ -805,6 +1916,7 @@ void *handle_client_request(void *client_socket)
                     }
                     char rep[1024];
 
+                    schedLeave(&ticket);
                     recv(client_fd, rep, sizeof(rep), 0);
                     // printf("recieved ack from client %s\n",rep);
                     printf("%s received from client for %s", rep, operation);
@@ -815,18 +1927,13 @@ void *handle_client_request(void *client_socket)
             else if (strcmp(operation, "DELETE") == 0)
             {
 
-                if (scn(path_cache, src_path) == -1)
-                {
+                server_index = lookup_server_index(src_path);
+                if (server_index != -1)
+                    server_index = pick_live_replica(src_path, server_index);
 
-                    server_index = searchTrie(path_trie, src_path);
-                    if (server_index != -1)
-                        insert(path_cache, src_path, server_index);
-                }
-                else
-                {
-                    printf("Cache Hit\n");
-                    server_index = scn(path_cache, src_path);
-                }
+                // Remember the whole chain now, change_ss drops the path from the trie
+                int replicas[MAX_REPLICAS];
+                int replica_count = path_replicas(src_path, replicas, MAX_REPLICAS);
                 ServerInfo server_info;
 
                 if (server_index != -1)
@@ -899,7 +2006,18 @@ void *handle_client_request(void *client_socket)
                             if (strstr(ack, "success") != NULL)
                             {
                                 change_ss(server_index, src_path, "DELETE");
-                                deleteCh(path_cache, src_path);
+                                forget_cached_path(src_path);
+
+                                for (int r = 0; r < replica_count; r++)
+                                {
+                                    char replica_ack[256];
+                                    if (replicas[r] == server_index || !ss_alive[replicas[r]])
+                                        continue;
+                                    if (ss_request(replicas[r], "DELETE", src_path, NULL, NULL, replica_ack, sizeof(replica_ack)) > 0 && strstr(replica_ack, "success") != NULL)
+                                        change_ss(replicas[r], src_path, "DELETE");
+                                    else
+                                        log_message("Could not delete replica of %s on storage server %d\n", src_path, replicas[r]);
+                                }
                             }
                             send(client_fd, ack, ack_len, 0); // Send acknowledgment back to the client
                         }
@@ -929,7 +2047,9 @@ void *handle_client_request(void *client_socket)
             else if (strcmp(operation, "CREATE") == 0)
             {
 
+                pthread_mutex_lock(&cache_lock);
                 server_index = searchTrie(path_trie, src_path);
+                pthread_mutex_unlock(&cache_lock);
                 ServerInfo server_info;
 
                 if (server_index == -1)
@@ -946,6 +2066,17 @@ void *handle_client_request(void *client_socket)
                     if (sdx < 0)
                         sdx = 0;
 
+                    // Under hash placement the ring decides, the client's choice is only a fallback
+                    if (placement_mode == PLACEMENT_HASH)
+                    {
+                        int owner = placement_owner(src_path);
+                        if (owner != -1 && owner != sdx)
+                        {
+                            log_message("Placing %s on storage server %d (ring owner) instead of %d\n", src_path, owner, sdx);
+                            sdx = owner;
+                        }
+                    }
+
                     ss_fd1 = socket(AF_INET, SOCK_STREAM, 0);
                     struct sockaddr_in ss_addr;
                     ss_addr.sin_family = AF_INET;
@@ -991,7 +2122,10 @@ void *handle_client_request(void *client_socket)
 
                         {
                             if (strstr(ack, "success") != NULL)
+                            {
                                 change_ss(sdx, src_path, "CREATE");
+                                replicate_create(sdx, src_path, p);
+                            }
                             printf("ack-- %s\n", ack);
                             log_message("ack-- %s\n", ack);
                             send(client_fd, ack, ack_len, 0); // Send acknowledgment back to the client
@@ -1023,33 +2157,13 @@ void *handle_client_request(void *client_socket)
 
                 if (src_path != NULL && dest_path != NULL)
                 {
-                    int src_server_index;
-                    if (scn(path_cache, src_path) == -1)
-                    {
-
-                        src_server_index = searchTrie(path_trie, src_path);
-                        if (src_server_index != -1)
-                            insert(path_cache, src_path, src_server_index);
-                    }
-                    else
-                    {
-                        printf("Cache Hit\n");
-                        src_server_index = scn(path_cache, src_path);
-                    }
+                    int src_server_index = lookup_server_index(src_path);
+                    if (src_server_index != -1)
+                        src_server_index = pick_live_replica(src_path, src_server_index);
 
-                    int dest_server_index;
-                    if (scn(path_cache, dest_path) == -1)
-                    {
-
-                        dest_server_index = searchTrie(path_trie, dest_path);
-                        if (dest_server_index != -1)
-                            insert(path_cache, dest_path, dest_server_index);
-                    }
-                    else
-                    {
-                        printf("Cache Hit\n");
-                        dest_server_index = scn(path_cache, dest_path);
-                    }
+                    int dest_server_index = lookup_server_index(dest_path);
+                    if (dest_server_index != -1)
+                        dest_server_index = pick_live_replica(dest_path, dest_server_index);
 
                     printf("%d %d\n", src_server_index, dest_server_index);
 
@@ -1081,6 +2195,9 @@ void *handle_client_request(void *client_socket)
                             strncpy(request->src_path, src_path, sizeof(request->src_path) - 1);
                             strncpy(request->dest_path, dest_path, sizeof(request->dest_path) - 1);
                             memset(request->data, 0, sizeof(request->data));
+                            // Across servers the destination pulls the data from the source itself
+                            if (src_server_index != dest_server_index)
+                                snprintf(request->data, sizeof(request->data), "%s:%d", ss_info[src_server_index].ip, ss_info[src_server_index].extra_ss_port);
 
                             if (send(ss_fd1, request, sizeof(Request), 0) == -1)
                             {
@@ -1126,21 +2243,77 @@ void *handle_client_request(void *client_socket)
             else if (strcmp(operation, "LIST") == 0)
             {
             cc1:
-                // Handle listing all accessible paths
-                printf("%d\n", c_ss);
-                send(client_fd, &c_ss, sizeof(int), 0);
-                for (int i = 0; i <= c_ss; i++)
+                // LIST [prefix] [cursor] [limit]: one page of the prefix's trie subtree
+                char *prefix = strtok(NULL, " ");
+                char *cursor = strtok(NULL, " ");
+                char *limit_arg = strtok(NULL, " ");
+                int limit = limit_arg ? atoi(limit_arg) : LIST_PAGE_DEFAULT;
+                if (limit <= 0 || limit > LIST_PAGE_MAX)
+                    limit = LIST_PAGE_MAX;
+                if (prefix == NULL)
+                    prefix = "";
+                if (cursor != NULL && strcmp(cursor, "-") == 0)
+                    cursor = NULL;
+
+                const RouteEntry *list_owner = foreign_route(prefix);
+                if (list_owner != NULL)
                 {
-                    printf("INDEX : %d   ", i);
-                    send(client_fd, &i, sizeof(int), 0);
-                    printf("PATHS: %s\n", ss_info[i].file_paths);
-                    send(client_fd, ss_info[i].file_paths, sizeof(ss_info[i].file_paths), 0);
+                    send_redirect(client_fd, "LIST", list_owner);
+                    continue;
                 }
+
+                ListBuffer page = {NULL, 0, 0, 0, limit, 0};
+                pthread_mutex_lock(&cache_lock);
+                listTrie(path_trie, prefix, cursor, limit + 1, append_list_entry, &page);
+                pthread_mutex_unlock(&cache_lock);
+
+                ListPage header = {page.count, page.more, (int)page.length};
+                send(client_fd, &header, sizeof(header), 0);
+                if (page.length > 0)
+                    send(client_fd, page.data, page.length, 0);
+                free(page.data);
+                log_message("LIST %s: %d entries, %zu bytes\n", prefix, page.count, page.length);
+
                 char buff[1024];
                 recv(client_fd, buff, sizeof(buff), 0);
                 log_message("%s\n", buff);
                 printf("%s\n", buff);
             }
+            else if (strcmp(operation, "ROUTES") == 0)
+            {
+            cc2:
+                // The routing table clients cache to pick a shard: an int count followed by the entries
+                send(client_fd, &routes.count, sizeof(int), 0);
+                if (routes.count > 0)
+                    send(client_fd, routes.entries, routes.count * sizeof(RouteEntry), 0);
+            }
+            else if (strcmp(operation, "STATS") == 0)
+            {
+            cc3:
+                // Counters of the naming server, one text line
+                char stats[1024] = "rate limiting off";
+                if (rate_limiter != NULL)
+                    rateStats(rate_limiter, stats, sizeof(stats));
+                if (scheduler != NULL)
+                {
+                    strcat(stats, "\n");
+                    schedStats(scheduler, stats + strlen(stats), sizeof(stats) - strlen(stats));
+                }
+                snprintf(stats + strlen(stats), sizeof(stats) - strlen(stats), "\nlookups performed=%lld shared=%lld, metadata fetches performed=%lld shared=%lld",
+                         lookup_flights->leaders, lookup_flights->shared, meta_flights->leaders, meta_flights->shared);
+                send(client_fd, stats, strlen(stats), 0);
+            }
+            else if (strcmp(operation, "SUBSCRIBE") == 0)
+            {
+            cc4s:
+                // This connection only carries Invalidation messages from now on
+                pthread_mutex_lock(&subscriber_lock);
+                if (subscriber_count < MAX_SUBSCRIBERS)
+                    subscribers[subscriber_count++] = client_fd;
+                else
+                    shutdown(client_fd, SHUT_RDWR);
+                pthread_mutex_unlock(&subscriber_lock);
+            }
             else if (strcmp(operation, "QUIT") == 0)
             {
             cc10:
@@ -1159,6 +2332,8 @@ void *handle_client_request(void *client_socket)
         }
     }
 
+    schedLeave(&ticket);
+    remove_subscriber(client_fd);
     close(client_fd); // Clean up client connection
     pthread_exit(NULL);
 }
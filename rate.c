@@ -0,0 +1,121 @@
+#include "rate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void initBucket(TokenBucket *bucket, double rate, double burst, long long now) {
+    bucket->rate = rate;
+    bucket->burst = burst < 1 ? 1 : burst;
+    bucket->tokens = bucket->burst;  // Start full so new clients are not throttled
+    bucket->last_ns = now;
+}
+
+static void refillBucket(TokenBucket *bucket, long long now) {
+    bucket->tokens += bucket->rate * (now - bucket->last_ns) / 1e9;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->last_ns = now;
+}
+
+// Milliseconds until the bucket holds a whole token again
+static int bucketWaitMs(const TokenBucket *bucket) {
+    int ms = (int)((1.0 - bucket->tokens) * 1000.0 / bucket->rate) + 1;
+    return ms < 1 ? 1 : ms;
+}
+
+// Function to create a limiter, a rate of 0 disables that bucket (burst defaults to one second of rate)
+RateLimiter* createRateLimiter(int client_rate, int client_burst, int global_rate, int global_burst) {
+    RateLimiter *limiter = (RateLimiter*)calloc(1, sizeof(RateLimiter));
+    if (!limiter) {
+        perror("Rate limiter allocation failed");
+        return NULL;
+    }
+    long long now = nowNs();
+    limiter->client_rate = client_rate;
+    limiter->client_burst = client_burst > 0 ? client_burst : client_rate;
+    initBucket(&limiter->global, global_rate, global_burst > 0 ? global_burst : global_rate, now);
+    pthread_mutex_init(&limiter->lock, NULL);
+    return limiter;
+}
+
+// Find the client's bucket, recycling the least recently used slot of its probe window if it is new
+static TokenBucket* clientBucket(RateLimiter *limiter, unsigned int ip, long long now) {
+    unsigned int start = (ip * 2654435761u) % RATE_CLIENT_SLOTS;
+    ClientBucket *victim = NULL;
+    for (int i = 0; i < RATE_PROBE; i++) {
+        ClientBucket *slot = &limiter->slots[(start + i) % RATE_CLIENT_SLOTS];
+        if (slot->in_use && slot->ip == ip) {
+            return &slot->bucket;
+        }
+        if (!slot->in_use) {
+            if (victim == NULL || victim->in_use) {
+                victim = slot;  // Free slots first
+            }
+        } else if (victim == NULL || (victim->in_use && slot->bucket.last_ns < victim->bucket.last_ns)) {
+            victim = slot;
+        }
+    }
+    victim->ip = ip;
+    victim->in_use = 1;
+    initBucket(&victim->bucket, limiter->client_rate, limiter->client_burst, now);
+    return &victim->bucket;
+}
+
+// Function to charge one request to the client's and the global bucket.
+// Returns 1 if admitted, otherwise 0 with the suggested wait in retry_ms; a refused request costs nothing
+int rateAdmit(RateLimiter *limiter, unsigned int ip, int *retry_ms) {
+    long long now = nowNs();
+    int admitted = 1;
+
+    pthread_mutex_lock(&limiter->lock);
+    TokenBucket *client = limiter->client_rate > 0 ? clientBucket(limiter, ip, now) : NULL;
+    TokenBucket *global = limiter->global.rate > 0 ? &limiter->global : NULL;
+
+    if (client) {
+        refillBucket(client, now);
+    }
+    if (global) {
+        refillBucket(global, now);
+    }
+
+    if (client && client->tokens < 1) {
+        admitted = 0;
+        *retry_ms = bucketWaitMs(client);
+        limiter->throttled_client++;
+    } else if (global && global->tokens < 1) {
+        admitted = 0;
+        *retry_ms = bucketWaitMs(global);
+        limiter->throttled_global++;
+    } else {
+        if (client) {
+            client->tokens -= 1;
+        }
+        if (global) {
+            global->tokens -= 1;
+        }
+        limiter->admitted++;
+    }
+    pthread_mutex_unlock(&limiter->lock);
+    return admitted;
+}
+
+// Function to format the limiter's counters as one line
+void rateStats(RateLimiter *limiter, char *buffer, size_t size) {
+    int tracked = 0;
+    pthread_mutex_lock(&limiter->lock);
+    for (int i = 0; i < RATE_CLIENT_SLOTS; i++) {
+        tracked += limiter->slots[i].in_use;
+    }
+    snprintf(buffer, size, "admitted=%lld throttled_client=%lld throttled_global=%lld tracked_clients=%d client_rate=%.0f/s global_rate=%.0f/s",
+             limiter->admitted, limiter->throttled_client, limiter->throttled_global, tracked,
+             limiter->client_rate, limiter->global.rate);
+    pthread_mutex_unlock(&limiter->lock);
+}
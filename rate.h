@@ -0,0 +1,41 @@
+#ifndef RATE_H
+#define RATE_H
+
+#include <pthread.h>
+
+#define RATE_CLIENT_SLOTS 1024 // Client IPs tracked at once, the least recently seen one is recycled
+#define RATE_PROBE 8           // Slots probed per client before recycling
+
+// Token bucket: refills at rate tokens per second up to burst, rate 0 means unlimited
+typedef struct {
+    double tokens;       // Tokens currently available
+    double rate;         // Refill rate, tokens per second
+    double burst;        // Bucket size
+    long long last_ns;   // Time of the last refill (CLOCK_MONOTONIC)
+} TokenBucket;
+
+// Bucket of one client IP
+typedef struct {
+    unsigned int ip;     // IPv4 address in network order
+    int in_use;          // 1 once the slot holds a client
+    TokenBucket bucket;
+} ClientBucket;
+
+// Admission control for the naming server: one bucket per client IP plus a global one
+typedef struct {
+    ClientBucket slots[RATE_CLIENT_SLOTS];
+    TokenBucket global;
+    double client_rate;
+    double client_burst;
+    long long admitted;          // Requests let through
+    long long throttled_client;  // Refused by the client's own bucket
+    long long throttled_global;  // Refused by the global bucket
+    pthread_mutex_t lock;
+} RateLimiter;
+
+// Function declarations
+RateLimiter* createRateLimiter(int client_rate, int client_burst, int global_rate, int global_burst);
+int rateAdmit(RateLimiter *limiter, unsigned int ip, int *retry_ms);
+void rateStats(RateLimiter *limiter, char *buffer, size_t size);
+
+#endif // RATE_H
@@ -0,0 +1,128 @@
+#include "ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Function to create an empty ring
+HashRing* createHashRing() {
+    HashRing *ring = (HashRing*)malloc(sizeof(HashRing));
+    if (!ring) {
+        perror("Ring allocation failed");
+        return NULL;
+    }
+    ring->points = NULL;
+    ring->count = 0;
+    ring->capacity = 0;
+    return ring;
+}
+
+// FNV-1a over the key followed by a final avalanche so nearby keys land far apart
+unsigned int ringHash(const char *key) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int comparePoints(const void *a, const void *b) {
+    unsigned int ha = ((const RingPoint *)a)->hash;
+    unsigned int hb = ((const RingPoint *)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// Function to place RING_VNODES points for a server, label should be stable across restarts (ip:port)
+void ringAddServer(HashRing *ring, int server_index, const char *label) {
+    ringRemoveServer(ring, server_index);  // Never place a server twice
+
+    if (ring->count + RING_VNODES > ring->capacity) {
+        int capacity = ring->capacity ? ring->capacity * 2 : RING_VNODES * 4;
+        while (capacity < ring->count + RING_VNODES) {
+            capacity *= 2;
+        }
+        RingPoint *points = (RingPoint*)realloc(ring->points, capacity * sizeof(RingPoint));
+        if (!points) {
+            perror("Ring allocation failed");
+            return;
+        }
+        ring->points = points;
+        ring->capacity = capacity;
+    }
+
+    char vnode[300];
+    for (int i = 0; i < RING_VNODES; i++) {
+        snprintf(vnode, sizeof(vnode), "%s#%d", label, i);
+        ring->points[ring->count].hash = ringHash(vnode);
+        ring->points[ring->count].server_index = server_index;
+        ring->count++;
+    }
+    qsort(ring->points, ring->count, sizeof(RingPoint), comparePoints);
+}
+
+// Function to drop every point owned by a server
+void ringRemoveServer(HashRing *ring, int server_index) {
+    int kept = 0;
+    for (int i = 0; i < ring->count; i++) {
+        if (ring->points[i].server_index != server_index) {
+            ring->points[kept++] = ring->points[i];
+        }
+    }
+    ring->count = kept;
+}
+
+// Index of the first point at or after hash, wrapping around the ring
+static int firstPointAfter(HashRing *ring, unsigned int hash) {
+    int low = 0, high = ring->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (ring->points[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low == ring->count ? 0 : low;
+}
+
+// Function to find the server owning a key, -1 if the ring is empty
+int ringLookup(HashRing *ring, const char *key) {
+    if (ring->count == 0) {
+        return -1;
+    }
+    return ring->points[firstPointAfter(ring, ringHash(key))].server_index;
+}
+
+// Function to collect up to max distinct servers walking clockwise from the key, owner first
+int ringLookupReplicas(HashRing *ring, const char *key, int *out, int max) {
+    int found = 0;
+    if (ring->count == 0) {
+        return 0;
+    }
+    int start = firstPointAfter(ring, ringHash(key));
+    for (int step = 0; step < ring->count && found < max; step++) {
+        int server_index = ring->points[(start + step) % ring->count].server_index;
+        int seen = 0;
+        for (int j = 0; j < found; j++) {
+            if (out[j] == server_index) {
+                seen = 1;
+                break;
+            }
+        }
+        if (!seen) {
+            out[found++] = server_index;
+        }
+    }
+    return found;
+}
+
+// Function to free the ring
+void freeHashRing(HashRing *ring) {
+    free(ring->points);
+    free(ring);
+}
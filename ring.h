@@ -0,0 +1,28 @@
+#ifndef RING_H
+#define RING_H
+
+#define RING_VNODES 64 // Virtual nodes per storage server on the ring
+
+// One virtual node: a point on the ring owned by a storage server
+typedef struct {
+    unsigned int hash;   // Position on the ring
+    int server_index;    // Storage server owning this point
+} RingPoint;
+
+// Consistent hash ring, points kept sorted by hash
+typedef struct {
+    RingPoint *points;   // Sorted array of virtual nodes
+    int count;           // Number of points on the ring
+    int capacity;        // Allocated size of points
+} HashRing;
+
+// Function declarations
+HashRing* createHashRing();
+unsigned int ringHash(const char *key);
+void ringAddServer(HashRing *ring, int server_index, const char *label);
+void ringRemoveServer(HashRing *ring, int server_index);
+int ringLookup(HashRing *ring, const char *key);
+int ringLookupReplicas(HashRing *ring, const char *key, int *out, int max);
+void freeHashRing(HashRing *ring);
+
+#endif // RING_H
@@ -0,0 +1,66 @@
+#include "route.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Function to fill a table from "prefix=ip:port;prefix=ip:port", returns the number of routes or -1 on a bad entry
+int parseRoutes(RouteTable *table, const char *spec) {
+    table->count = 0;
+    char *copy = strdup(spec);
+    if (!copy) {
+        perror("Route allocation failed");
+        return -1;
+    }
+
+    char *saveptr;
+    for (char *entry = strtok_r(copy, ";", &saveptr); entry != NULL; entry = strtok_r(NULL, ";", &saveptr)) {
+        if (table->count >= MAX_ROUTES) {
+            fprintf(stderr, "Too many routes, only %d are used\n", MAX_ROUTES);
+            break;
+        }
+        RouteEntry *route = &table->entries[table->count];
+        memset(route, 0, sizeof(RouteEntry));
+        if (sscanf(entry, " %255[^=]=%15[^:]:%d", route->prefix, route->ip, &route->port) != 3) {
+            fprintf(stderr, "Bad route \"%s\", expected prefix=ip:port\n", entry);
+            free(copy);
+            return -1;
+        }
+        // "/a/" and "/a" name the same range
+        size_t length = strlen(route->prefix);
+        if (length > 1 && route->prefix[length - 1] == '/') {
+            route->prefix[length - 1] = '\0';
+        }
+        table->count++;
+    }
+    free(copy);
+    return table->count;
+}
+
+// A prefix covers a path when it matches up to a component boundary, so "/a" owns "/a/x" but not "/ab"
+static int prefixCovers(const char *prefix, const char *path) {
+    size_t length = strlen(prefix);
+    if (strncmp(prefix, path, length) != 0) {
+        return 0;
+    }
+    return length == 0 || prefix[length - 1] == '/' || path[length] == '\0' || path[length] == '/';
+}
+
+// Function to find the route owning a path by longest prefix match, NULL if no prefix covers it
+const RouteEntry* routeLookup(const RouteTable *table, const char *path) {
+    const RouteEntry *best = NULL;
+    size_t best_length = 0;
+    for (int i = 0; i < table->count; i++) {
+        const RouteEntry *route = &table->entries[i];
+        size_t length = strlen(route->prefix);
+        if (prefixCovers(route->prefix, path) && (best == NULL || length > best_length)) {
+            best = route;
+            best_length = length;
+        }
+    }
+    return best;
+}
+
+// Function to tell whether a route points at the naming server listening on ip:port
+int routeIsSelf(const RouteEntry *route, const char *ip, int port) {
+    return route->port == port && strcmp(route->ip, ip) == 0;
+}
@@ -0,0 +1,25 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#define MAX_ROUTES 64      // Path-prefix ranges in one routing table
+#define ROUTE_REDIRECT -2  // Marker a naming server returns for a path owned by another shard
+
+// One shard of the naming service: every path under prefix is owned by the naming server at ip:port
+typedef struct {
+    char prefix[256];  // Path prefix, matched on whole components ("/" owns everything not claimed elsewhere)
+    char ip[16];       // Naming server IP address
+    int port;          // Naming server client port
+} RouteEntry;
+
+// Routing table shared by every naming server and cached by clients
+typedef struct {
+    RouteEntry entries[MAX_ROUTES];
+    int count;
+} RouteTable;
+
+// Function declarations
+int parseRoutes(RouteTable *table, const char *spec);
+const RouteEntry* routeLookup(const RouteTable *table, const char *path);
+int routeIsSelf(const RouteEntry *route, const char *ip, int port);
+
+#endif // ROUTE_H
@@ -0,0 +1,125 @@
+#include "sched.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Function to create a dispatcher with the given number of slots, per-class weights and per-class slot limits
+Scheduler* createScheduler(int slots, const int weights[SCHED_CLASSES], const int limits[SCHED_CLASSES]) {
+    Scheduler *sched = (Scheduler*)calloc(1, sizeof(Scheduler));
+    if (!sched) {
+        perror("Scheduler allocation failed");
+        return NULL;
+    }
+    pthread_mutex_init(&sched->lock, NULL);
+    sched->slots = slots < 1 ? 1 : slots;
+    for (int c = 0; c < SCHED_CLASSES; c++) {
+        sched->weight[c] = weights[c] < 1 ? 1 : weights[c];
+        sched->limit[c] = limits[c] < 1 || limits[c] > sched->slots ? sched->slots : limits[c];
+    }
+    return sched;
+}
+
+// Hand free slots to waiting requests, lowest pass first; caller holds the lock
+static void dispatchLocked(Scheduler *sched) {
+    while (sched->busy < sched->slots) {
+        int next = -1;
+        for (int c = 0; c < SCHED_CLASSES; c++) {
+            if (sched->head[c] != NULL && sched->running[c] < sched->limit[c] &&
+                (next == -1 || sched->pass[c] < sched->pass[next])) {
+                next = c;
+            }
+        }
+        if (next == -1) {
+            return;  // Nothing waiting, or every waiting class is at its limit
+        }
+
+        SchedWaiter *waiter = sched->head[next];
+        sched->head[next] = waiter->next;
+        if (sched->head[next] == NULL) {
+            sched->tail[next] = NULL;
+        }
+        sched->vtime = sched->pass[next];
+        sched->pass[next] += SCHED_STRIDE / sched->weight[next];
+        sched->running[next]++;
+        sched->busy++;
+        waiter->granted = 1;
+        pthread_cond_signal(&waiter->cond);
+    }
+}
+
+// Function to wait in the class queue until the dispatcher grants a slot
+void schedEnter(Scheduler *sched, SchedTicket *ticket, int sched_class) {
+    ticket->sched = sched;
+    ticket->sched_class = sched_class;
+    ticket->held = 0;
+    if (sched == NULL) {
+        return;
+    }
+
+    SchedWaiter waiter;
+    waiter.next = NULL;
+    waiter.granted = 0;
+    pthread_cond_init(&waiter.cond, NULL);
+    long long start = nowNs();
+
+    pthread_mutex_lock(&sched->lock);
+    if (sched->head[sched_class] == NULL && sched->running[sched_class] == 0 && sched->pass[sched_class] < sched->vtime) {
+        sched->pass[sched_class] = sched->vtime;  // An idle class does not bank credit
+    }
+    if (sched->tail[sched_class] != NULL) {
+        sched->tail[sched_class]->next = &waiter;
+    } else {
+        sched->head[sched_class] = &waiter;
+    }
+    sched->tail[sched_class] = &waiter;
+
+    dispatchLocked(sched);
+    while (!waiter.granted) {
+        pthread_cond_wait(&waiter.cond, &sched->lock);
+    }
+
+    long long waited = nowNs() - start;
+    sched->dispatched[sched_class]++;
+    sched->wait_ns[sched_class] += waited;
+    if (waited > sched->max_wait_ns[sched_class]) {
+        sched->max_wait_ns[sched_class] = waited;
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    pthread_cond_destroy(&waiter.cond);
+    ticket->held = 1;
+}
+
+// Function to give the slot back as soon as the naming server's part of a request is done
+void schedLeave(SchedTicket *ticket) {
+    if (ticket->sched == NULL || !ticket->held) {
+        return;
+    }
+    Scheduler *sched = ticket->sched;
+    pthread_mutex_lock(&sched->lock);
+    sched->running[ticket->sched_class]--;
+    sched->busy--;
+    dispatchLocked(sched);
+    pthread_mutex_unlock(&sched->lock);
+    ticket->held = 0;
+}
+
+// Function to format dispatch counts and queueing delay per class
+void schedStats(Scheduler *sched, char *buffer, size_t size) {
+    static const char *names[SCHED_CLASSES] = {"lookup", "mutation", "bulk"};
+    size_t used = 0;
+    pthread_mutex_lock(&sched->lock);
+    for (int c = 0; c < SCHED_CLASSES && used < size; c++) {
+        long long avg_us = sched->dispatched[c] ? sched->wait_ns[c] / sched->dispatched[c] / 1000 : 0;
+        used += snprintf(buffer + used, size - used, "%s%s=%lld (wait avg %lldus max %lldus)",
+                         c ? " " : "", names[c], sched->dispatched[c], avg_us, sched->max_wait_ns[c] / 1000);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
@@ -0,0 +1,52 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// Request classes, scheduled through separate queues
+#define SCHED_LOOKUP 0    // READ, STREAM, GET_INFO, STAT, LIST: latency sensitive
+#define SCHED_MUTATION 1  // WRITE, CREATE: single path changes
+#define SCHED_BULK 2      // DELETE, COPY: may walk whole trees on the storage servers
+#define SCHED_CLASSES 3
+
+#define SCHED_STRIDE 1000000LL // Pass advance of a weight 1 class per dispatch
+
+// One thread waiting in a class queue
+typedef struct SchedWaiter {
+    struct SchedWaiter *next;
+    pthread_cond_t cond;
+    int granted;
+} SchedWaiter;
+
+// Weighted fair dispatcher: at most slots requests run at once, the waiting class with the lowest pass goes next
+typedef struct {
+    pthread_mutex_t lock;
+    SchedWaiter *head[SCHED_CLASSES];  // FIFO queue per class
+    SchedWaiter *tail[SCHED_CLASSES];
+    int weight[SCHED_CLASSES];         // Share of dispatches while classes compete
+    int limit[SCHED_CLASSES];          // Slots a class may hold at once
+    int running[SCHED_CLASSES];        // Slots a class holds now
+    long long pass[SCHED_CLASSES];     // Stride scheduling virtual time per class
+    long long vtime;                   // Pass of the last dispatch, idle classes restart from here
+    int slots;                         // Requests running at once
+    int busy;                          // Slots in use
+    long long dispatched[SCHED_CLASSES];
+    long long wait_ns[SCHED_CLASSES];  // Total queueing delay
+    long long max_wait_ns[SCHED_CLASSES];
+} Scheduler;
+
+// A request's hold on a slot, leaving twice is harmless
+typedef struct {
+    Scheduler *sched;
+    int sched_class;
+    int held;
+} SchedTicket;
+
+// Function declarations
+Scheduler* createScheduler(int slots, const int weights[SCHED_CLASSES], const int limits[SCHED_CLASSES]);
+void schedEnter(Scheduler *sched, SchedTicket *ticket, int sched_class);
+void schedLeave(SchedTicket *ticket);
+void schedStats(Scheduler *sched, char *buffer, size_t size);
+
+#endif // SCHED_H
@@ -24,6 +24,7 @@ typedef struct
     char src_path[256];
     char dest_path[256];
     char data[1024];
+    Capability cap; // Grant from the naming server, checked for client data operations when CAP_KEY is set
 
 } Request;
 
@@ -33,6 +34,15 @@ typedef struct
     struct sockaddr_in address;
 } C_args;
 
+// One entry of a MANIFEST reply, followed by path_length bytes of path relative to the requested path
+typedef struct
+{
+    char kind; // 'F' file, 'D' directory, 'E' end of manifest, 'X' requested path not found
+    int path_length;
+    long long size;
+    long long mtime;
+} ManifestEntry;
+
 struct storage_server
 {
     char ip[INET_ADDRSTRLEN];
@@ -56,9 +66,19 @@ void collect_file_paths(const char *directory, char *paths, int *num_paths);
 void collect_file_paths_recursively(const char *directory, char *paths, int *num_paths, int *capacity, int *current_length);
 void send_server_details(int sock, struct storage_server *server_details);
 int create_socket_and_connect(const char *ip, int port);
+int forward_write_to_chain(Request *request, int flag);
+int forward_upload_to_chain(Request *request, const char *full_path);
+int connect_to_peer(const char *address);
+void pull_from_peer(Request *request, const char *full_path, int sock);
+void send_manifest(const char *path, int sock);
+int copy_from_peer(Request *request, int sock);
 
 char home_directory[128];
 struct storage_server server_details;
+char *cap_key; // CAP_KEY: secret shared with the naming server, NULL accepts requests without a capability
+int copy_streams = 4; // SS_COPY_STREAMS: connections a cross-server COPY pulls files over in parallel
+int client_op_capability(const char *operation);
+int capability_allows(Request *request);
 int main(int argc, char *argv[])
 {
     if (argc != 5)
@@ -70,6 +90,49 @@ int main(int argc, char *argv[])
     int client_storage_port = atoi(argv[2]);
     int port_nm = atoi(argv[3]);
     int extra = atoi(argv[4]);
+    if (getenv("CAP_KEY") != NULL && getenv("CAP_KEY")[0] != '\0')
+        cap_key = strdup(getenv("CAP_KEY"));
+    if (getenv("SS_STREAM_CHUNK") != NULL && atol(getenv("SS_STREAM_CHUNK")) >= 4096)
+        stream_chunk = (size_t)atol(getenv("SS_STREAM_CHUNK"));
+    if (getenv("SS_COPY_WORKERS") != NULL)
+        copy_workers = atoi(getenv("SS_COPY_WORKERS"));
+    if (getenv("SS_FLUSH_DELAY_MS") != NULL && atoi(getenv("SS_FLUSH_DELAY_MS")) >= 0)
+        flush_delay_ms = atoi(getenv("SS_FLUSH_DELAY_MS"));
+    if (getenv("SS_FLUSH_BYTES") != NULL && atol(getenv("SS_FLUSH_BYTES")) > 0)
+        flush_bytes = (size_t)atol(getenv("SS_FLUSH_BYTES"));
+    if (getenv("SS_DURABILITY") != NULL)
+    {
+        if (strcmp(getenv("SS_DURABILITY"), "group") == 0)
+            durability = DURABILITY_GROUP;
+        else if (strcmp(getenv("SS_DURABILITY"), "dsync") == 0)
+            durability = DURABILITY_DSYNC;
+        else if (strcmp(getenv("SS_DURABILITY"), "none") != 0)
+            fprintf(stderr, "Unknown SS_DURABILITY %s, using none\n", getenv("SS_DURABILITY"));
+    }
+    int fd_cache_size = FD_CACHE_DEFAULT;
+    if (getenv("SS_FD_CACHE") != NULL && atoi(getenv("SS_FD_CACHE")) >= 0)
+        fd_cache_size = atoi(getenv("SS_FD_CACHE"));
+    fd_cache = createFdCache(fd_cache_size);
+    size_t block_cache_size = BLOCK_CACHE_DEFAULT;
+    size_t block_cache_file = BLOCK_CACHE_MAX_FILE;
+    if (getenv("SS_BLOCK_CACHE") != NULL && atol(getenv("SS_BLOCK_CACHE")) >= 0)
+        block_cache_size = (size_t)atol(getenv("SS_BLOCK_CACHE"));
+    if (getenv("SS_BLOCK_CACHE_FILE") != NULL && atol(getenv("SS_BLOCK_CACHE_FILE")) >= 0)
+        block_cache_file = (size_t)atol(getenv("SS_BLOCK_CACHE_FILE"));
+    block_cache = createBlockCache(block_cache_size, block_cache_file);
+#ifdef USE_IO_URING
+    int uring_rings = URING_RINGS_DEFAULT;
+    if (getenv("SS_URING_RINGS") != NULL && atoi(getenv("SS_URING_RINGS")) >= 0)
+        uring_rings = atoi(getenv("SS_URING_RINGS"));
+    if (uring_rings > 0)
+        uring_pool = createUringPool(uring_rings);
+#endif
+    if (getenv("SS_WRITE_SHARDS") != NULL)
+        write_shards = atoi(getenv("SS_WRITE_SHARDS"));
+    if (getenv("SS_WRITE_BACKLOG") != NULL && atol(getenv("SS_WRITE_BACKLOG")) > 0)
+        write_backlog = (size_t)atol(getenv("SS_WRITE_BACKLOG"));
+    if (getenv("SS_COPY_STREAMS") != NULL && atoi(getenv("SS_COPY_STREAMS")) > 0)
+        copy_streams = atoi(getenv("SS_COPY_STREAMS"));
 
     printf("%d %d %d\n", port_nm, client_storage_port, extra);
     char current_directory[MAX_PATHS];
@@ -98,6 +161,13 @@ int main(int argc, char *argv[])
     int sock = create_socket_and_connect(argv[1], port_nm);
 
     send_server_details(sock, &server_details);
+
+    // The registration connection stays open and carries metadata for every path we serve
+    nm_notify_sock = sock;
+    char *paths = strdup(server_details.file_paths);
+    for (char *path = strtok(paths, "\n"); path != NULL; path = strtok(NULL, "\n"))
+        notifyMetadata(path);
+    free(paths);
     pthread_t naming_server_thread, client_handler_thread;
     int p_client = server_details.port_client;
     int p_nm = server_details.extra_ss_port;
@@ -324,7 +394,7 @@ void *handle_client_request(void *args)
         close(client_sock);
         return NULL;
     }
-    if (recv(client_sock, request, sizeof(Request), 0) <= 0)
+    if (recv(client_sock, request, sizeof(Request), MSG_WAITALL) <= 0)
     {
         perror("Failed to receive request from client");
         free(request);
@@ -333,6 +403,27 @@ void *handle_client_request(void *args)
     }
 
     printf("Received request: %s %s %s %s\n", request->operation, request->src_path, request->dest_path, request->data);
+    if (client_op_capability(request->operation) == 0 || !capability_allows(request))
+    {
+        // STREAM clients wait for a status code first, READ for a length header, everything else reads a text ack
+        long long refused = -1;
+        if (strcmp(request->operation, "STREAM") == 0)
+            sendErrorCode(client_sock, -1);
+        else if (strcmp(request->operation, "READ") == 0)
+        {
+            send(client_sock, &refused, sizeof(refused), 0);
+            sendErrorCode(client_sock, -1);
+        }
+        else if (client_op_capability(request->operation) == 0)
+            sendack(client_sock, "Access denied: not a client operation.");
+        else
+            sendack(client_sock, "Access denied: missing, invalid or expired capability.");
+        printf("Denied %s %s\n", request->operation, request->src_path);
+        free(request);
+        close(client_sock);
+        free(client_args);
+        return NULL;
+    }
     process_request(client_sock, request);
     free(request);
     close(client_sock);
@@ -349,8 +440,10 @@ void process_request(int client_sock, Request *request)
 
     if (strcmp(request->operation, "READ") == 0)
     {
-
-        readFile(full_path, client_sock);
+        // A ranged READ carries "offset length" in data, a plain READ leaves it empty
+        long long offset = 0, length = -1;
+        sscanf(request->data, "%lld %lld", &offset, &length);
+        readFile(full_path, offset, length, client_sock);
     }
     else if (strcmp(request->operation, "WRITE") == 0)
     {
@@ -362,10 +455,34 @@ void process_request(int client_sock, Request *request)
             return;
         }
         printf("flag taken-->%d\n", kya);
-        int flag = writeFile_with_sync_and_async(full_path, client_sock, request->data, kya);
+        int flag;
+        if (request->dest_path[0] == '\0')
+            flag = writeFile_with_sync_and_async(full_path, client_sock, request->data, kya);
+        else
+        {
+            // Chain head: apply here first, then pass the write down; the client is acked once the tail has it.
+            // A head that cannot write forwards nothing, so no replica ends up ahead of it. If the write does not
+            // reach the tail it failed: the head has it but some replicas do not, so the head has the naming
+            // server take the path off the others until they are re-synced. Replicas only report upstream
+            int applied = applyWrite(full_path, request->data, kya);
+            if (applied != WRITE_APPLIED)
+            {
+                sendack(client_sock, writeAckMessage(kya, applied));
+                return;
+            }
+            if (forward_write_to_chain(request, kya) != 0)
+            {
+                if ((kya & WRITE_REPLICA) == 0)
+                    notifyLaggingReplicas(full_path);
+                sendack(client_sock, "Write failed: the replica chain could not be updated.");
+                return;
+            }
+            sendack(client_sock, writeAckMessage(kya, applied));
+            flag = (kya & WRITE_SYNC) ? 1 : 0;
+        }
         printf("flag==:%d\n", flag);
 
-        if (kya == 0)
+        if ((kya & WRITE_SYNC) == 0)
         { 
             
              int port=8080;
@@ -384,6 +501,8 @@ void process_request(int client_sock, Request *request)
     
 }
     server_addr.sin_port = htons(8080);
+    int reuse = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)); // The previous async write's port may linger
 
     // Bind the socket to the specified address and port
     if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
@@ -418,9 +537,26 @@ void process_request(int client_sock, Request *request)
                 fprintf(stderr, "Partial send: only %zd bytes sent instead of %zu\n", bytes_sent, sizeof(int));
                   
             }
+            close(new_sock);
             close(sockfd);
         }
     }
+    else if (strcmp(request->operation, "UPLOAD") == 0)
+    {
+        // Whole-file replacement streamed in chunks, then passed down the replica chain like a WRITE
+        long long stored = receiveUpload(full_path, client_sock);
+        char ack[BUFFER_SIZE];
+        if (stored < 0)
+            sendack(client_sock, "Upload failed.");
+        else if (request->dest_path[0] != '\0' && forward_upload_to_chain(request, full_path) != 0)
+            sendack(client_sock, "Replica chain upload failed.");
+        else
+        {
+            notifyMetadata(full_path);
+            snprintf(ack, sizeof(ack), "Upload completed successfully: %lld bytes.", stored);
+            sendack(client_sock, ack);
+        }
+    }
     else if (strcmp(request->operation, "SIZE") == 0)
     {
         getFileSize(full_path, client_sock);
@@ -444,17 +580,50 @@ void process_request(int client_sock, Request *request)
             return;
         }
         printf("kya recv\n");
-        createFileOrDirectory(client_sock, request->src_path, request->data, kya);
+        if (createFileOrDirectory(client_sock, request->src_path, request->data, kya) == 0)
+            notifyMetadata(request->src_path);
     }
     else if (strcmp(request->operation, "DELETE") == 0)
     {
 
-        deleteFileOrDirectory(client_sock, request->src_path);
+        if (deleteFileOrDirectory(client_sock, request->src_path) == 0)
+            notifyMetadata(request->src_path);
     }
     else if (strcmp(request->operation, "COPY") == 0)
     {
-
-        copyPath(request->src_path, request->dest_path, client_sock);
+        // The naming server puts the source storage server's address in data when the source lives elsewhere. COPY
+        // only arrives on the naming port, the client port refuses it, so clients cannot point us at a source
+        int result = request->data[0] != '\0' ? copy_from_peer(request, client_sock)
+                                               : copyPath(request->src_path, request->dest_path, client_sock);
+        if (result == 0)
+            notifyMetadata(request->dest_path);
+    }
+    else if (strcmp(request->operation, "FETCH") == 0)
+    {
+        // data carries the offset to resume from, empty for the whole file
+        long long offset = 0;
+        sscanf(request->data, "%lld", &offset);
+        sendWholeFile(full_path, offset, client_sock);
+    }
+    else if (strcmp(request->operation, "MANIFEST") == 0)
+    {
+        send_manifest(full_path, client_sock);
+    }
+    else if (strcmp(request->operation, "PULL") == 0)
+    {
+        pull_from_peer(request, full_path, client_sock);
+        notifyMetadata(request->src_path);
+    }
+    else if (strcmp(request->operation, "STAT") == 0)
+    {
+        sendMetaRecord(full_path, client_sock);
+    }
+    else if (strcmp(request->operation, "STATS") == 0)
+    {
+        // Cache counters of this storage server, one text line
+        char stats[512];
+        blockCacheStats(block_cache, stats, sizeof(stats));
+        send(client_sock, stats, strlen(stats), 0);
     }
     else if (strcmp(request->operation, "GET_INFO") == 0)
     {
@@ -473,6 +642,584 @@ void process_request(int client_sock, Request *request)
     }
 }
 
+// Connect to another storage server given as "ip:port"
+int connect_to_peer(const char *address)
+{
+    char ip[INET_ADDRSTRLEN + 8];
+    strncpy(ip, address, sizeof(ip) - 1);
+    ip[sizeof(ip) - 1] = '\0';
+
+    char *colon = strrchr(ip, ':');
+    if (colon == NULL)
+        return -1;
+    *colon = '\0';
+    int port = atoi(colon + 1);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    struct sockaddr_in peer_addr;
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &peer_addr.sin_addr) <= 0 ||
+        connect(sock, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) < 0)
+    {
+        perror("Connection to storage server peer failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// The capability a client data operation needs, 0 if the operation is not served on the client port. Naming
+// server and peer traffic (CREATE, DELETE, COPY, PULL, FETCH, MANIFEST, STAT, STATS) uses the naming port
+int client_op_capability(const char *operation)
+{
+    if (strcmp(operation, "WRITE") == 0 || strcmp(operation, "UPLOAD") == 0)
+        return CAP_WRITE;
+    if (strcmp(operation, "READ") == 0 || strcmp(operation, "STREAM") == 0 || strcmp(operation, "GET_INFO") == 0 ||
+        strcmp(operation, "SIZE") == 0 || strcmp(operation, "PERMISSION") == 0)
+        return CAP_READ;
+    return 0;
+}
+
+// Client data operations need a capability signed by the naming server for this path, checked locally. A WRITE or
+// UPLOAD is only passed on to what is left at this hop of the replica chain signed into it
+int capability_allows(Request *request)
+{
+    if (cap_key == NULL)
+        return 1;
+
+    int op = client_op_capability(request->operation);
+    if (!capVerify(&request->cap, cap_key, request->src_path, op, (long long)time(NULL)))
+        return 0;
+    if (op != CAP_WRITE || request->dest_path[0] == '\0')
+        return 1;
+
+    size_t chain_len = strnlen(request->cap.chain, sizeof(request->cap.chain));
+    size_t rest_len = strnlen(request->dest_path, sizeof(request->dest_path));
+    if (rest_len > chain_len)
+        return 0;
+    const char *rest = request->cap.chain + chain_len - rest_len;
+    return memcmp(rest, request->dest_path, rest_len) == 0 && (rest == request->cap.chain || rest[-1] == ',');
+}
+
+// Pass a WRITE to the next replica in request->dest_path ("ip:port,ip:port,...") and wait for the tail's ack
+int forward_write_to_chain(Request *request, int flag)
+{
+    char next[64];
+    const char *rest = strchr(request->dest_path, ',');
+    size_t len = rest ? (size_t)(rest - request->dest_path) : strlen(request->dest_path);
+    if (len >= sizeof(next))
+        return -1;
+    memcpy(next, request->dest_path, len);
+    next[len] = '\0';
+
+    int sock = connect_to_peer(next);
+    if (sock < 0)
+        return -1;
+
+    // Replicas always apply synchronously so the ack really comes from the tail, with the durability asked for here
+    Request forward = *request;
+    memset(forward.dest_path, 0, sizeof(forward.dest_path));
+    if (rest != NULL)
+        strncpy(forward.dest_path, rest + 1, sizeof(forward.dest_path) - 1);
+    int sync = flag | WRITE_SYNC | WRITE_REPLICA;
+
+    char ack[BUFFER_SIZE];
+    int ack_len = -1;
+    if (send(sock, &forward, sizeof(Request), 0) == sizeof(Request) && send(sock, &sync, sizeof(int), 0) == sizeof(int))
+        ack_len = recv(sock, ack, sizeof(ack) - 1, 0);
+    close(sock);
+
+    if (ack_len <= 0)
+        return -1;
+    ack[ack_len] = '\0';
+    printf("Replica %s acknowledged: %s\n", next, ack);
+    return strstr(ack, "completed successfully") != NULL ? 0 : -1;
+}
+
+// Pass an UPLOAD on to the next replica: the stored file goes out as a single chunk straight from the page cache
+int forward_upload_to_chain(Request *request, const char *full_path)
+{
+    char next[64];
+    const char *rest = strchr(request->dest_path, ',');
+    size_t len = rest ? (size_t)(rest - request->dest_path) : strlen(request->dest_path);
+    if (len >= sizeof(next))
+        return -1;
+    memcpy(next, request->dest_path, len);
+    next[len] = '\0';
+
+    struct stat st;
+    int fd = open(full_path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) != 0)
+    {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    int sock = connect_to_peer(next);
+    if (sock < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    Request forward = *request;
+    memset(forward.dest_path, 0, sizeof(forward.dest_path));
+    if (rest != NULL)
+        strncpy(forward.dest_path, rest + 1, sizeof(forward.dest_path) - 1);
+    long long length = (long long)st.st_size, end = 0;
+
+    char ack[BUFFER_SIZE];
+    int ack_len = -1;
+    if (send(sock, &forward, sizeof(Request), 0) == sizeof(Request) &&
+        (length == 0 || (send(sock, &length, sizeof(length), 0) == sizeof(length) && sendFileRange(fd, 0, length, sock) == length)) &&
+        send(sock, &end, sizeof(end), 0) == sizeof(end))
+        ack_len = recv(sock, ack, sizeof(ack) - 1, 0);
+    close(fd);
+    close(sock);
+
+    if (ack_len <= 0)
+        return -1;
+    ack[ack_len] = '\0';
+    printf("Replica %s acknowledged: %s\n", next, ack);
+    return strstr(ack, "completed successfully") != NULL ? 0 : -1;
+}
+
+// PULL: fetch request->src_path from the storage server at request->dest_path ("ip:port" of its naming port)
+void pull_from_peer(Request *request, const char *full_path, int sock)
+{
+    int peer = connect_to_peer(request->dest_path);
+    if (peer < 0)
+    {
+        sendack(sock, "failed: source storage server unreachable");
+        return;
+    }
+
+    Request fetch;
+    memset(&fetch, 0, sizeof(fetch));
+    strncpy(fetch.operation, "FETCH", sizeof(fetch.operation) - 1);
+    memcpy(fetch.src_path, request->src_path, sizeof(fetch.src_path));
+
+    int result = -1;
+    if (send(peer, &fetch, sizeof(Request), 0) == sizeof(Request))
+        result = receiveWholeFile(full_path, peer);
+    close(peer);
+
+    printf("Pulled %s from %s: %s\n", request->src_path, request->dest_path, result == 0 ? "ok" : "failed");
+    sendack(sock, result == 0 ? "success" : "failed: transfer from source storage server");
+}
+
+// Send one manifest entry, returns -1 once the peer is gone
+int send_manifest_entry(int sock, char kind, const char *relative, long long size, long long mtime)
+{
+    ManifestEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.kind = kind;
+    entry.path_length = (int)strlen(relative);
+    entry.size = size;
+    entry.mtime = mtime;
+    if (send(sock, &entry, sizeof(entry), 0) != sizeof(entry))
+        return -1;
+    if (entry.path_length > 0 && send(sock, relative, entry.path_length, 0) != entry.path_length)
+        return -1;
+    return 0;
+}
+
+// Walk a directory relative to its fd, parents before their contents
+int send_manifest_dir(int sock, int dir_fd, char *relative, size_t used)
+{
+    int list_fd = dup(dir_fd);
+    DIR *dir = list_fd == -1 ? NULL : fdopendir(list_fd);
+    if (dir == NULL)
+    {
+        if (list_fd != -1)
+            close(list_fd);
+        return 0;
+    }
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        struct stat st;
+        size_t name_length = strlen(entry->d_name);
+        if (used + name_length + 2 > PATH_LENGTH || fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        snprintf(relative + used, PATH_LENGTH - used, "%s%s", used ? "/" : "", entry->d_name);
+        size_t child_used = used + name_length + (used ? 1 : 0);
+
+        if (S_ISREG(st.st_mode))
+            result = send_manifest_entry(sock, 'F', relative, (long long)st.st_size, (long long)st.st_mtime);
+        else if (S_ISDIR(st.st_mode))
+        {
+            result = send_manifest_entry(sock, 'D', relative, 0, (long long)st.st_mtime);
+            int child_fd = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (result == 0 && child_fd != -1)
+                result = send_manifest_dir(sock, child_fd, relative, child_used);
+            if (child_fd != -1)
+                close(child_fd);
+        }
+        relative[used] = '\0';
+    }
+    closedir(dir);
+    return result;
+}
+
+// MANIFEST: list a file or a directory tree for a peer about to copy it, ends with an 'E' entry
+void send_manifest(const char *path, int sock)
+{
+    struct stat st;
+    char relative[PATH_LENGTH] = "";
+    if (stat(path, &st) == -1 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+    {
+        send_manifest_entry(sock, 'X', "", 0, 0);
+        return;
+    }
+    if (S_ISREG(st.st_mode))
+    {
+        if (send_manifest_entry(sock, 'F', "", (long long)st.st_size, (long long)st.st_mtime) == 0)
+            send_manifest_entry(sock, 'E', "", 0, 0);
+        return;
+    }
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (send_manifest_entry(sock, 'D', "", 0, (long long)st.st_mtime) == 0 &&
+        (dir_fd == -1 || send_manifest_dir(sock, dir_fd, relative, 0) == 0))
+        send_manifest_entry(sock, 'E', "", 0, 0);
+    if (dir_fd != -1)
+        close(dir_fd);
+}
+
+#define PEER_PIPELINE_DEPTH 4 // FETCHes a copy stream keeps in flight
+#define PEER_COPY_RETRIES 3   // Reconnects per file before it is given up
+#define PEER_RECV_BUFFER (256 * 1024)
+
+typedef struct
+{
+    char *relative;
+    long long size;
+    long long mtime;
+    long long offset; // Where the current request resumes, bytes already in the partial file
+} PeerFile;
+
+// A cross-server copy in progress: every stream takes the next file from the shared list
+typedef struct
+{
+    pthread_mutex_t lock;
+    const char *source; // "ip:port" of the source storage server's naming port
+    const char *src_root;
+    const char *dst_root;
+    PeerFile *files;
+    int count;
+    int next;
+    long long copied;
+    long long failed;
+    long long bytes;
+    long long resumed; // Bytes not sent again thanks to partial files
+    int skipped;       // Files failed up front because a path of theirs does not fit
+} PeerCopy;
+
+// root/relative into out, -1 if it does not fit: a cut path would name some other file
+int peer_path(const char *root, const char *relative, char *out, size_t size)
+{
+    int length = snprintf(out, size, "%s%s%s", root, relative[0] ? "/" : "", relative);
+    return length >= 0 && (size_t)length < size ? 0 : -1;
+}
+
+// Partial files carry the source's size and mtime, so a retried COPY only resumes the same version of the file
+int peer_part_path(PeerCopy *copy, PeerFile *file, char *out, size_t size)
+{
+    char dst[PATH_LENGTH];
+    if (peer_path(copy->dst_root, file->relative, dst, sizeof(dst)) == -1)
+        return -1;
+    int length = snprintf(out, size, "%s.part-%lld-%lld", dst, file->size, file->mtime);
+    return length >= 0 && (size_t)length < size ? 0 : -1;
+}
+
+// Whether the source path, local path and partial file path of file all fit their buffers
+int peer_file_fits(PeerCopy *copy, PeerFile *file)
+{
+    Request fetch;
+    char part[PATH_LENGTH + 64], dst[PATH_LENGTH];
+    return peer_path(copy->src_root, file->relative, fetch.src_path, sizeof(fetch.src_path)) == 0 &&
+           peer_path(copy->dst_root, file->relative, dst, sizeof(dst)) == 0 &&
+           peer_part_path(copy, file, part, sizeof(part)) == 0;
+}
+
+int take_peer_file(PeerCopy *copy)
+{
+    pthread_mutex_lock(&copy->lock);
+    int index = copy->next < copy->count ? copy->next++ : -1;
+    pthread_mutex_unlock(&copy->lock);
+    return index;
+}
+
+void finish_peer_file(PeerCopy *copy, PeerFile *file, int ok)
+{
+    pthread_mutex_lock(&copy->lock);
+    if (ok)
+    {
+        copy->copied++;
+        copy->bytes += file->size - file->offset;
+        copy->resumed += file->offset;
+    }
+    else
+    {
+        copy->failed++;
+        printf("Copy of %s/%s from %s failed\n", copy->src_root, file->relative, copy->source);
+    }
+    pthread_mutex_unlock(&copy->lock);
+}
+
+// Ask the source for a file, from the end of the partial file if an earlier attempt left one
+int request_peer_file(PeerCopy *copy, PeerFile *file, int peer)
+{
+    char part[PATH_LENGTH + 64];
+    struct stat st;
+    if (peer_part_path(copy, file, part, sizeof(part)) == -1)
+        return -1;
+    file->offset = stat(part, &st) == 0 && st.st_size <= file->size ? (long long)st.st_size : 0;
+
+    Request fetch;
+    memset(&fetch, 0, sizeof(fetch));
+    strncpy(fetch.operation, "FETCH", sizeof(fetch.operation) - 1);
+    if (peer_path(copy->src_root, file->relative, fetch.src_path, sizeof(fetch.src_path)) == -1)
+        return -1;
+    snprintf(fetch.data, sizeof(fetch.data), "%lld", file->offset);
+    return send(peer, &fetch, sizeof(fetch), 0) == sizeof(fetch) ? 0 : -1;
+}
+
+// Receive one requested file into its partial file and rename it into place.
+// Returns 0 when done, -2 when the file failed but the stream is intact, -1 when the stream broke
+int receive_peer_file(PeerCopy *copy, PeerFile *file, int peer, char *buffer)
+{
+    long long length;
+    if (recv(peer, &length, sizeof(length), MSG_WAITALL) != sizeof(length))
+        return -1;
+    if (length < 0)
+        return -2;
+
+    char part[PATH_LENGTH + 64], dst[PATH_LENGTH];
+    int fd = -1;
+    if (peer_part_path(copy, file, part, sizeof(part)) == 0 && peer_path(copy->dst_root, file->relative, dst, sizeof(dst)) == 0)
+        fd = open(part, O_CREAT | O_WRONLY | (file->offset == 0 ? O_TRUNC : 0), 0666);
+    if (fd != -1 && lseek(fd, file->offset, SEEK_SET) == -1)
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    long long received = 0;
+    while (received < length)
+    {
+        size_t want = (length - received) > PEER_RECV_BUFFER ? PEER_RECV_BUFFER : (size_t)(length - received);
+        ssize_t n = recv(peer, buffer, want, 0);
+        if (n <= 0)
+            break;
+        if (fd != -1 && write(fd, buffer, n) != n)
+        {
+            close(fd);
+            fd = -1; // Keep draining so the stream stays usable
+        }
+        received += n;
+    }
+    if (fd == -1)
+        return received == length ? -2 : -1;
+    if (received != length)
+    {
+        close(fd);
+        return -1; // The partial file stays for the next attempt
+    }
+    int result = ftruncate(fd, file->offset + length) == 0 && close(fd) == 0 && rename(part, dst) == 0 ? 0 : -2;
+    if (result != 0)
+        unlink(part);
+    else
+        invalidatePath(dst);
+    return result;
+}
+
+// One copy stream: a connection to the source with up to PEER_PIPELINE_DEPTH FETCHes in flight, reconnecting and
+// resuming from the partial files when the connection breaks
+void *peer_copy_stream(void *args)
+{
+    PeerCopy *copy = (PeerCopy *)args;
+    char *buffer = malloc(PEER_RECV_BUFFER);
+    int pending[PEER_PIPELINE_DEPTH];
+    int pending_count = 0, requested = 0, failures = 0, peer = -1, index;
+    while (buffer != NULL)
+    {
+        while (pending_count < PEER_PIPELINE_DEPTH && (index = take_peer_file(copy)) != -1)
+            pending[pending_count++] = index;
+        if (pending_count == 0)
+            break;
+
+        if (peer < 0)
+        {
+            peer = connect_to_peer(copy->source);
+            requested = 0;
+        }
+        while (peer >= 0 && requested < pending_count && request_peer_file(copy, &copy->files[pending[requested]], peer) == 0)
+            requested++;
+
+        int result = peer >= 0 && requested > 0 ? receive_peer_file(copy, &copy->files[pending[0]], peer, buffer) : -1;
+        if (result == -1)
+        {
+            if (peer >= 0)
+                close(peer);
+            peer = -1;
+            if (++failures <= PEER_COPY_RETRIES)
+            {
+                usleep(100000 * failures);
+                continue;
+            }
+        }
+        finish_peer_file(copy, &copy->files[pending[0]], result == 0);
+        failures = 0;
+        memmove(pending, pending + 1, (pending_count - 1) * sizeof(int));
+        pending_count--;
+        if (requested > 0)
+            requested--;
+    }
+    while (pending_count > 0)
+        finish_peer_file(copy, &copy->files[pending[--pending_count]], 0);
+    if (peer >= 0)
+        close(peer);
+    free(buffer);
+    return NULL;
+}
+
+// Read a MANIFEST reply into the file list, creating the directories on the way. Returns 0 when complete
+int receive_manifest(PeerCopy *copy, int peer, long long *dirs, char *error, size_t error_size)
+{
+    int capacity = 0;
+    while (1)
+    {
+        ManifestEntry entry;
+        char relative[PATH_LENGTH];
+        if (recv(peer, &entry, sizeof(entry), MSG_WAITALL) != sizeof(entry) || entry.path_length < 0 ||
+            entry.path_length >= PATH_LENGTH ||
+            (entry.path_length > 0 && recv(peer, relative, entry.path_length, MSG_WAITALL) != entry.path_length))
+        {
+            snprintf(error, error_size, "source storage server closed the connection");
+            return -1;
+        }
+        relative[entry.path_length] = '\0';
+        if (entry.kind == 'E')
+            return 0;
+        if (entry.kind == 'X')
+        {
+            snprintf(error, error_size, "source path not found on source storage server");
+            return -1;
+        }
+
+        if (entry.kind == 'D')
+        {
+            char dst[PATH_LENGTH];
+            if (peer_path(copy->dst_root, relative, dst, sizeof(dst)) == -1)
+            {
+                snprintf(error, error_size, "path too long: %s", relative);
+                return -1;
+            }
+            if (mkdir(dst, 0777) == -1 && errno != EEXIST)
+            {
+                snprintf(error, error_size, "unable to create %s", dst);
+                return -1;
+            }
+            (*dirs)++;
+            continue;
+        }
+        if (copy->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            PeerFile *grown = realloc(copy->files, capacity * sizeof(PeerFile));
+            if (grown == NULL)
+            {
+                snprintf(error, error_size, "out of memory");
+                return -1;
+            }
+            copy->files = grown;
+        }
+        PeerFile *file = &copy->files[copy->count];
+        file->relative = relative;
+        file->size = entry.size;
+        file->mtime = entry.mtime;
+        file->offset = 0;
+        if (!peer_file_fits(copy, file))
+        {
+            printf("Copy of %s/%s from %s failed: path too long\n", copy->src_root, relative, copy->source);
+            copy->failed++;
+            copy->skipped++;
+            continue;
+        }
+        file->relative = strdup(relative);
+        copy->count++;
+    }
+}
+
+// Cross-server COPY: pull request->src_path from the storage server at request->data ("ip:port" of its naming port)
+// into request->dest_path over copy_streams parallel pipelined connections, then send one ack with the totals
+int copy_from_peer(Request *request, int sock)
+{
+    PeerCopy copy;
+    memset(&copy, 0, sizeof(copy));
+    pthread_mutex_init(&copy.lock, NULL);
+    copy.source = request->data;
+    copy.src_root = request->src_path;
+    copy.dst_root = request->dest_path;
+
+    char error[PATH_LENGTH + 64] = "";
+    long long dirs = 0;
+    int result = -1;
+    Request manifest;
+    memset(&manifest, 0, sizeof(manifest));
+    strncpy(manifest.operation, "MANIFEST", sizeof(manifest.operation) - 1);
+    memcpy(manifest.src_path, request->src_path, sizeof(manifest.src_path));
+    int peer = connect_to_peer(copy.source);
+    if (peer < 0)
+        snprintf(error, sizeof(error), "source storage server unreachable");
+    else if (send(peer, &manifest, sizeof(manifest), 0) != sizeof(manifest))
+        snprintf(error, sizeof(error), "source storage server closed the connection");
+    else
+        result = receive_manifest(&copy, peer, &dirs, error, sizeof(error));
+    if (peer >= 0)
+        close(peer);
+
+    if (result == 0 && copy.count > 0)
+    {
+        int streams = copy_streams < copy.count ? copy_streams : copy.count;
+        pthread_t *threads = malloc(streams * sizeof(pthread_t));
+        int started = 0;
+        while (threads != NULL && started < streams && pthread_create(&threads[started], NULL, peer_copy_stream, &copy) == 0)
+            started++;
+        if (started == 0)
+            peer_copy_stream(&copy);
+        for (int i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+    }
+
+    // The source is an "ip:port", and the error names at most one path: clip both so the ack stays in one buffer
+    char ack[BUFFER_SIZE];
+    if (result != 0)
+        snprintf(ack, sizeof(ack), "Copy from %.64s failed: %.900s.", copy.source, error);
+    else if (copy.failed > 0)
+        snprintf(ack, sizeof(ack), "Copy from %.64s failed: %lld of %d files could not be copied, run COPY again to resume.",
+                 copy.source, copy.failed, copy.count + copy.skipped);
+    else
+        snprintf(ack, sizeof(ack), "Copied from %.64s successfully: %lld files, %lld directories, %lld bytes (%lld resumed).",
+                 copy.source, copy.copied, dirs, copy.bytes, copy.resumed);
+    sendack(sock, ack);
+
+    for (int i = 0; i < copy.count; i++)
+        free(copy.files[i].relative);
+    free(copy.files);
+    pthread_mutex_destroy(&copy.lock);
+    return result == 0 && copy.failed == 0 ? 0 : -1;
+}
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~below work are related to naming server~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
@@ -537,6 +1284,11 @@ void *handle_naming_request(void *args)
     }
     printf("Received request in naming server : %s %s %s %s\n", request->operation, request->src_path, request->dest_path, request->data);
     process_request(nm_ss_sock, request);
+    // A peer pulling files keeps the connection and sends its next FETCH without waiting for the previous file
+    while (strcmp(request->operation, "FETCH") == 0 &&
+           recv(nm_ss_sock, request, sizeof(Request), MSG_WAITALL) == sizeof(Request) &&
+           strcmp(request->operation, "FETCH") == 0)
+        process_request(nm_ss_sock, request);
     free(request);
     close(nm_ss_sock);
     free(client_args);
@@ -17,7 +17,29 @@
 #include <netdb.h>
 #include <ifaddrs.h>
 
+#include "cap.h"
+#include "fdcache.h"
+#include "blockcache.h"
+#include "uring.h"
+
 #define BUFFER_SIZE 1024
+#define COPY_MAX_WORKERS 64
+#define DEFAULT_FLUSH_DELAY_MS 5             // Group commit window of the asynchronous writer
+#define DEFAULT_FLUSH_BYTES (1024 * 1024)    // Queued bytes that end the window early
+#define DEFAULT_WRITE_BACKLOG (64 * 1024 * 1024) // Queued bytes per writer before asynchronous writers wait
+#define WRITE_MAX_SHARDS 64
+#define WRITE_LOCK_STRIPES 256 // Per-file write locks, picked by device and inode
+#define WRITE_SYNC 1             // WRITE flag: acknowledge after writing instead of queueing
+#define WRITE_REPLICA 2          // WRITE flag: passed down a replica chain, not sent by a client
+#define WRITE_DURABILITY_SHIFT 4 // WRITE flag bits from here: durability + 1, 0 keeps SS_DURABILITY
+#define DURABILITY_NONE 0        // Acknowledged once in the page cache
+#define DURABILITY_GROUP 1       // fdatasync before the ack, shared by writers of the file that arrive meanwhile
+#define DURABILITY_DSYNC 2       // O_DSYNC, every write reaches the disk on its own
+#define WRITE_APPLIED 0      // applyWrite results
+#define WRITE_OPEN_FAILED -1
+#define WRITE_FAILED -2
+#define WRITE_NO_MEMORY -3
+#define STREAM_CHUNK_DEFAULT (1024 * 1024) // Bytes per sendfile call while streaming
 
 struct FileMetadata
 {
@@ -29,6 +51,32 @@ struct FileMetadata
   char last_status_change[BUFFER_SIZE];
 };
 
+// Compact metadata record, pushed to the naming server on changes and returned by STAT
+typedef struct
+{
+  char kind; // 'U' updated, 'D' deleted, 'E' could not stat, 'L' updated here only, the other replicas lag
+  char path[256];
+  long long size;
+  int mode;
+  long long atime;
+  long long mtime;
+  long long ctime;
+} MetaRecord;
+
+extern int nm_notify_sock; // Registration connection to the naming server, carries MetaRecords
+extern size_t stream_chunk; // SS_STREAM_CHUNK: bytes handed to sendfile at a time by STREAM
+extern int flush_delay_ms;  // SS_FLUSH_DELAY_MS: longest an asynchronous write waits for others to batch with
+extern size_t flush_bytes;  // SS_FLUSH_BYTES: queued bytes that flush the batch right away
+extern int durability;      // SS_DURABILITY: none, group or dsync, for WRITEs that do not choose
+extern FdCache *fd_cache;    // Open descriptors shared by READ, WRITE, STREAM, SIZE and GET_INFO, sized by SS_FD_CACHE
+extern BlockCache *block_cache; // Contents of small hot files for READ, sized by SS_BLOCK_CACHE, NULL when off
+#ifdef USE_IO_URING
+extern UringPool *uring_pool; // SS_URING_RINGS rings for READ, STREAM and FETCH transfers, NULL (the default) uses sendfile
+#endif
+extern int write_shards;    // SS_WRITE_SHARDS: asynchronous writer threads, files are spread over them by path, 0 picks the cores
+extern size_t write_backlog; // SS_WRITE_BACKLOG: queued bytes per writer beyond which asynchronous WRITEs wait
+extern int copy_workers;    // SS_COPY_WORKERS: threads copying files in a directory COPY, 0 picks twice the cores
+
 struct proc
 {
   pid_t pid;
@@ -43,19 +91,35 @@ const char *errorCodeToMessage(int errorCode);
 
 void sendErrorMessage(int socket, int errorCode);
 
+int recvAll(int socket, void *buffer, size_t length);
+int makeParentDirs(const char *path);
+void invalidatePath(const char *path);
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~NM intraction~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 int createFileOrDirectory(int sock, const char *path, const char *name, int kya);
 int deleteFileOrDirectory(int sock, const char *path);
 int copyDirectory(const char *src_dir, const char *dst_dir, int sock);
 int copyPath(const char *src, const char *dst, int sock);
+int copyFileData(int src_fd, int dst_fd);
 int copyFile(const char *src, const char *dst, int sock);
 char *get_ip_address();
-void *asyncWrite(void *arg);
+pthread_mutex_t *fileWriteLock(int fd);
+int applyWrite(const char *path, const char *data, int syncFlag);
+const char *writeAckMessage(int syncFlag, int result);
 int writeFile_with_sync_and_async(const char *path, int socket, const char *data, int syncFlag);
+void fillMetaRecord(const char *path, MetaRecord *record);
+void notifyMetadata(const char *path);
+void notifyLaggingReplicas(const char *path);
+int sendMetaRecord(const char *path, int socket);
+long long sendFileRange(int fd, long long offset, long long length, int socket);
+int sendWholeFile(const char *path, long long offset, int socket);
+#define TRANSFER_IS_DIR -2 // sendWholeFile length header for a directory
+int receiveWholeFile(const char *path, int socket);
+long long receiveUpload(const char *path, int socket);
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~client intraction~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-int readFile(const char *path, int socket);
+int readFile(const char *path, long long offset, long long length, int socket);
 int writeFile(const char *path, int socket, const char *data);
 int getFileSize(const char *path, int socket);
 int getFilePermissions(const char *path, int socket);
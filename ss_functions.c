@@ -1,5 +1,15 @@
+#define _GNU_SOURCE // copy_file_range
 #include "ss_function.h"
 #include <netdb.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #define PATH_MAX 4096
 
 // IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII~~error_handling~~IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII
@@ -92,236 +102,1281 @@ void sendErrorMessage(int socket, int errorCode)
   }
 }
 
+// Keep calling recv until length bytes arrived, returns 0 on success and -1 if the peer went away
+int recvAll(int socket, void *buffer, size_t length)
+{
+  size_t received = 0;
+  while (received < length)
+  {
+    ssize_t n = recv(socket, (char *)buffer + received, length - received, 0);
+    if (n <= 0)
+    {
+      return -1;
+    }
+    received += n;
+  }
+  return 0;
+}
+
+// mkdir -p for every directory above path
+int makeParentDirs(const char *path)
+{
+  char dir[PATH_MAX];
+  strncpy(dir, path, sizeof(dir) - 1);
+  dir[sizeof(dir) - 1] = '\0';
+
+  for (char *p = dir + 1; *p; p++)
+  {
+    if (*p != '/')
+    {
+      continue;
+    }
+    *p = '\0';
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST)
+    {
+      return -1;
+    }
+    *p = '/';
+  }
+  return 0;
+}
+
+// A synchronous writer waiting for its data to reach the disk
+typedef struct SyncWaiter
+{
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  int error;
+  int done;
+  struct SyncWaiter *next;
+} SyncWaiter;
+
+// Writers to one file serialize on the stripe its device and inode hash to, whatever path named it, so writes
+// to different files go ahead in parallel. The stripe also batches their fdatasyncs
 typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t synced;
+  SyncWaiter *pending; // Written, waiting for the next fdatasync
+  int syncing;         // A leader is in fdatasync with the lock released
+} WriteStripe;
+
+static WriteStripe writeStripes[WRITE_LOCK_STRIPES];
+static pthread_once_t writeLocksReady = PTHREAD_ONCE_INIT;
+
+int durability = DURABILITY_NONE;
+FdCache *fd_cache;
+BlockCache *block_cache;
+
+// Forget everything cached for path and below it, after it was deleted or replaced
+void invalidatePath(const char *path)
+{
+  fdCacheInvalidate(fd_cache, path);
+  blockCacheInvalidate(block_cache, path);
+}
+
+static void initWriteLocks()
+{
+  for (int i = 0; i < WRITE_LOCK_STRIPES; i++)
+  {
+    pthread_mutex_init(&writeStripes[i].lock, NULL);
+    pthread_cond_init(&writeStripes[i].synced, NULL);
+  }
+}
+
+static WriteStripe *fileWriteStripe(const struct stat *st)
+{
+  pthread_once(&writeLocksReady, initWriteLocks);
+  unsigned long long key = ((unsigned long long)st->st_dev << 32 ^ (unsigned long long)st->st_ino) * 0x9E3779B97F4A7C15ULL;
+  return &writeStripes[(key >> 32) % WRITE_LOCK_STRIPES];
+}
+
+pthread_mutex_t *fileWriteLock(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+  {
+    memset(&st, 0, sizeof(st));
+  }
+  return &fileWriteStripe(&st)->lock;
+}
+
+// Group commit for synchronous writes, called with the stripe locked right after writing to fd. Whoever finds no
+// fdatasync running takes every writer queued so far and syncs each of their files once, with the lock released
+// so the next group can write and queue meanwhile; the rest sleep until their group is done. Returns 0 once the
+// write is on disk, -1 if its file failed to sync
+static int waitDurable(WriteStripe *stripe, int fd, const struct stat *st)
+{
+  // self lives on this stack; a leader takes it off pending before it is marked done, and it is unlinked again
+  // below before returning in case that ever changes
+  SyncWaiter self = {fd, st->st_dev, st->st_ino, 0, 0, stripe->pending};
+  stripe->pending = &self;
+  while (!self.done)
+  {
+    if (stripe->syncing)
+    {
+      pthread_cond_wait(&stripe->synced, &stripe->lock);
+      continue;
+    }
+    stripe->syncing = 1;
+    SyncWaiter *group = stripe->pending;
+    stripe->pending = NULL;
+    pthread_mutex_unlock(&stripe->lock);
+
+    for (SyncWaiter *w = group; w != NULL; w = w->next)
+    {
+      SyncWaiter *first = group;
+      while (first != w && (first->dev != w->dev || first->ino != w->ino))
+      {
+        first = first->next;
+      }
+      if (first == w)
+      {
+        w->error = fdatasync(w->fd) == -1 ? -1 : 0;
+      }
+      else
+      {
+        w->error = first->error;
+      }
+    }
+
+    pthread_mutex_lock(&stripe->lock);
+    // Waiters leave as soon as done is set, so read next first
+    for (SyncWaiter *w = group, *next; w != NULL; w = next)
+    {
+      next = w->next;
+      w->done = 1;
+    }
+    stripe->syncing = 0;
+    pthread_cond_broadcast(&stripe->synced);
+  }
+  for (SyncWaiter **link = &stripe->pending; *link != NULL; link = &(*link)->next)
+  {
+    if (*link == &self)
+    {
+      *link = self.next;
+      break;
+    }
+  }
+  return self.error;
+}
+
+// stat through the descriptor cache, so hot files skip the path walk; falls back to stat for what cannot be opened
+static int cachedStat(const char *path, struct stat *st)
+{
+  CachedFd *entry = fdCacheOpen(fd_cache, path, FD_CACHE_READ);
+  if (entry == NULL)
+  {
+    return stat(path, st);
+  }
+  int result = fstat(entry->fd, st);
+  fdCacheRelease(fd_cache, entry);
+  return result;
+}
+
+// Write all of data, returns 0 on success and -1 on error
+static int writeAllData(int fd, const char *data, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t n = write(fd, data, length);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    length -= n;
+  }
+  return 0;
+}
+
+typedef struct WriteRequest
 {
   char *path;
   char *data;
-  int socket;
   size_t dataLength;
-  int priority;
+  int durable;               // fdatasync the file after writing the batch
+  int order;                 // Arrival within its batch
+  struct WriteRequest *next; // Link in the shard's queue
 } WriteRequest;
 
+// One asynchronous writer thread and its queue. Producers push with a single compare-and-swap onto a stack the
+// writer takes whole and reverses, so the queue is unbounded and never locked on the way in; the lock and
+// conditions below are only used to park the writer when idle and producers when the shard is over its backlog
 typedef struct
 {
-  WriteRequest *requests[20];
-  int size;
+  _Atomic(WriteRequest *) head; // Newest first
+  atomic_size_t bytes;          // Queued and not yet written
+  atomic_int parked;            // WRITER_IDLE or WRITER_BATCHING while the writer sleeps
+  atomic_int blocked;           // Producers waiting for room
   pthread_mutex_t lock;
-  pthread_cond_t cond;
-} PriorityQueue;
+  pthread_cond_t wake;
+  pthread_cond_t room;
+#ifdef USE_IO_URING
+  Uring *ring; // This writer's own ring, NULL to use plain writev
+#endif
+} WriteShard;
+
+#define WRITER_RUNNING 0
+#define WRITER_IDLE 1     // Woken by any write
+#define WRITER_BATCHING 2 // Woken once flush_bytes are queued
+
+int flush_delay_ms = DEFAULT_FLUSH_DELAY_MS;
+size_t flush_bytes = DEFAULT_FLUSH_BYTES;
+int write_shards = 0;
+size_t write_backlog = DEFAULT_WRITE_BACKLOG;
+
+static WriteShard *shards;
+static int shard_count;
+
+// Every write to one path goes to the same shard, which keeps them in order
+static WriteShard *shardFor(const char *path)
+{
+  unsigned long hash = 5381;
+  for (const unsigned char *p = (const unsigned char *)path; *p; p++)
+  {
+    hash = hash * 33 + *p;
+  }
+  return &shards[hash % shard_count];
+}
+
+void pushWriteRequest(WriteShard *shard, WriteRequest *request)
+{
+  // Backpressure: hold the client's handler until the writer catches up rather than grow without limit
+  if (atomic_load(&shard->bytes) >= write_backlog)
+  {
+    pthread_mutex_lock(&shard->lock);
+    atomic_fetch_add(&shard->blocked, 1);
+    while (atomic_load(&shard->bytes) >= write_backlog)
+    {
+      pthread_cond_wait(&shard->room, &shard->lock);
+    }
+    atomic_fetch_sub(&shard->blocked, 1);
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  size_t queued = atomic_fetch_add(&shard->bytes, request->dataLength) + request->dataLength;
+  WriteRequest *head = atomic_load(&shard->head);
+  do
+  {
+    request->next = head;
+  } while (!atomic_compare_exchange_weak(&shard->head, &head, request));
+
+  // The writer publishes parked before its last look at head, so either it sees this request or we see it parked
+  int parked = atomic_load(&shard->parked);
+  if (parked == WRITER_IDLE || (parked == WRITER_BATCHING && queued >= flush_bytes))
+  {
+    pthread_mutex_lock(&shard->lock);
+    pthread_cond_signal(&shard->wake);
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+// Group commit: once a write is waiting, give others up to flush_delay_ms to join it unless flush_bytes are
+// already queued, then take everything at once. Returns the requests oldest first
+WriteRequest *takeWriteBatch(WriteShard *shard)
+{
+  pthread_mutex_lock(&shard->lock);
+  atomic_store(&shard->parked, WRITER_IDLE);
+  while (atomic_load(&shard->head) == NULL)
+  {
+    pthread_cond_wait(&shard->wake, &shard->lock);
+  }
+  if (flush_delay_ms > 0)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)flush_delay_ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    atomic_store(&shard->parked, WRITER_BATCHING);
+    while (atomic_load(&shard->bytes) < flush_bytes &&
+           pthread_cond_timedwait(&shard->wake, &shard->lock, &deadline) != ETIMEDOUT)
+    {
+    }
+  }
+  atomic_store(&shard->parked, WRITER_RUNNING);
+  pthread_mutex_unlock(&shard->lock);
+
+  WriteRequest *stack = atomic_exchange(&shard->head, NULL);
+  WriteRequest *oldest = NULL;
+  while (stack != NULL)
+  {
+    WriteRequest *next = stack->next;
+    stack->next = oldest;
+    oldest = stack;
+    stack = next;
+  }
+  return oldest;
+}
 
-PriorityQueue *pq;
-PriorityQueue *createPriorityQueue()
+// Batch order: by path, then by arrival
+static int compareWrites(const void *a, const void *b)
 {
-  PriorityQueue *pq = malloc(sizeof(PriorityQueue));
-  pq->size = 0;
-  pthread_mutex_init(&pq->lock, NULL);
-  pthread_cond_init(&pq->cond, NULL);
-  return pq;
+  const WriteRequest *const *x = a;
+  const WriteRequest *const *y = b;
+  int order = strcmp((*x)->path, (*y)->path);
+  if (order != 0)
+  {
+    return order;
+  }
+  return (*x)->order - (*y)->order;
 }
 
-void insertRequest(PriorityQueue *pq, WriteRequest *request)
+#ifdef USE_IO_URING
+// What one SQE of a batch was for: user_data is its index in the batch's WriteSqe array
+typedef struct
+{
+  int file;     // Index of the file's first request, where its error is recorded
+  size_t bytes; // What a writev must return, 0 for the fdatasync
+} WriteSqe;
+
+static int compareLocks(const void *a, const void *b)
 {
-  pthread_mutex_lock(&pq->lock);
-  if (pq->size < 20)
+  uintptr_t x = (uintptr_t)*(pthread_mutex_t *const *)a;
+  uintptr_t y = (uintptr_t)*(pthread_mutex_t *const *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Wait for every SQE of a batch, recording failures per file; a writev that wrote less than its iovs failed too.
+// If the kernel refuses the submission, whatever it has not taken is taken back and failed, and what it did take
+// is still waited for, so the buffers and descriptors stay valid until it is done with them
+static void reapWriteBatch(Uring *ring, unsigned *inflight, const WriteSqe *sqes, int *errors)
+{
+  struct io_uring_cqe cqe;
+  while (*inflight > 0)
   {
-    pq->requests[pq->size++] = request;
-    for (int i = pq->size - 1; i > 0 && pq->requests[i]->priority < pq->requests[i - 1]->priority; i--)
+    if (uringSubmit(ring, 1) < 0 && errno != EAGAIN && errno != EBUSY)
     {
-      WriteRequest *temp = pq->requests[i];
-      pq->requests[i] = pq->requests[i - 1];
-      pq->requests[i - 1] = temp;
+      perror("io_uring submit failed");
+      struct io_uring_sqe unsent;
+      while (uringTakeBack(ring, &unsent))
+      {
+        (*inflight)--;
+        if (errors[sqes[unsent.user_data].file] == 0)
+        {
+          errors[sqes[unsent.user_data].file] = ECANCELED;
+        }
+      }
+      usleep(1000); // Give what the kernel took time to complete, then look again
+    }
+    while (uringPeekCqe(ring, &cqe))
+    {
+      (*inflight)--;
+      const WriteSqe *sent = &sqes[cqe.user_data];
+      int error = cqe.res < 0 ? -cqe.res : (size_t)cqe.res != sent->bytes ? EIO : 0;
+      if (error != 0 && errors[sent->file] == 0)
+      {
+        errors[sent->file] = error;
+      }
     }
   }
-  pthread_cond_signal(&pq->cond);
-  pthread_mutex_unlock(&pq->lock);
 }
 
-WriteRequest *removeHighestPriorityRequest(PriorityQueue *pq)
+// flushWriteBatch on io_uring, requests already sorted: every file's writevs, and its fdatasync when asked for,
+// go to the ring as one linked chain, and the chains of all files in the batch are submitted together. As in the
+// writev path the files' stripe locks are held until their chains completed, taken in address order since a
+// batch needs several at once
+static size_t flushWriteBatchUring(Uring *ring, WriteRequest **batch, int count)
 {
-  pthread_mutex_lock(&pq->lock);
-  while (pq->size == 0)
+  struct iovec *iov = malloc(count * sizeof(struct iovec));
+  CachedFd **entries = calloc(count, sizeof(CachedFd *));
+  int *errors = calloc(count, sizeof(int));
+  WriteSqe *sqes = calloc(2 * count, sizeof(WriteSqe)); // At most one writev per request and one fdatasync per file
+  pthread_mutex_t **locks = malloc(count * sizeof(pthread_mutex_t *));
+  if (iov == NULL || entries == NULL || errors == NULL || sqes == NULL || locks == NULL)
   {
-    pthread_cond_wait(&pq->cond, &pq->lock);
+    free(iov);
+    free(entries);
+    free(errors);
+    free(sqes);
+    free(locks);
+    return (size_t)-1;
+  }
+
+  int lockCount = 0;
+  for (int i = 0, end; i < count; i = end)
+  {
+    for (end = i; end < count && strcmp(batch[end]->path, batch[i]->path) == 0; end++)
+    {
+    }
+    entries[i] = fdCacheOpen(fd_cache, batch[i]->path, FD_CACHE_APPEND);
+    if (entries[i] == NULL)
+    {
+      perror("Failed to open file for asynchronous writing");
+      continue;
+    }
+    locks[lockCount++] = fileWriteLock(entries[i]->fd);
   }
-  WriteRequest *highestPriorityRequest = pq->requests[0];
-  for (int i = 1; i < pq->size; i++)
+  qsort(locks, lockCount, sizeof(pthread_mutex_t *), compareLocks);
+  for (int l = 0; l < lockCount; l++)
   {
-    pq->requests[i - 1] = pq->requests[i];
+    if (l == 0 || locks[l] != locks[l - 1])
+    {
+      pthread_mutex_lock(locks[l]);
+    }
   }
-  pq->size--;
-  pthread_mutex_unlock(&pq->lock);
-  return highestPriorityRequest;
+
+  unsigned inflight = 0;
+  int sqeCount = 0;
+  for (int i = 0, end; i < count; i = end)
+  {
+    int durable = 0;
+    for (end = i; end < count && strcmp(batch[end]->path, batch[i]->path) == 0; end++)
+    {
+      iov[end].iov_base = batch[end]->data;
+      iov[end].iov_len = batch[end]->dataLength;
+      durable |= batch[end]->durable;
+    }
+    if (entries[i] == NULL)
+    {
+      continue;
+    }
+
+    // One writev per IOV_MAX appends, then the fdatasync
+    int ops = (end - i + IOV_MAX - 1) / IOV_MAX + durable;
+    struct io_uring_sqe *last = NULL;
+    for (int op = 0; op < ops; op++)
+    {
+      int j = i + op * IOV_MAX;
+      struct io_uring_sqe *sqe = uringGetSqe(ring);
+      if (sqe == NULL)
+      {
+        // Ring full: end the chain here and let everything finish, which keeps the order just the same. The
+        // rest of this file's SQEs start a new chain
+        if (last != NULL)
+        {
+          last->flags &= ~IOSQE_IO_LINK;
+        }
+        reapWriteBatch(ring, &inflight, sqes, errors);
+        last = NULL;
+        sqe = uringGetSqe(ring);
+      }
+      if (last != NULL)
+      {
+        last->flags |= IOSQE_IO_LINK;
+      }
+      sqe->fd = entries[i]->fd;
+      sqe->user_data = sqeCount;
+      sqes[sqeCount].file = i;
+      sqes[sqeCount].bytes = 0;
+      if (j < end)
+      {
+        int pieces = end - j < IOV_MAX ? end - j : IOV_MAX;
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (unsigned long)(iov + j);
+        sqe->len = pieces;
+        sqe->off = (unsigned long long)-1; // Current position, appending anyway
+        for (int k = j; k < j + pieces; k++)
+        {
+          sqes[sqeCount].bytes += iov[k].iov_len;
+        }
+      }
+      else
+      {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+      }
+      sqeCount++;
+      last = sqe;
+      inflight++;
+    }
+  }
+  if (inflight > 0)
+  {
+    reapWriteBatch(ring, &inflight, sqes, errors);
+  }
+  for (int l = 0; l < lockCount; l++)
+  {
+    if (l == 0 || locks[l] != locks[l - 1])
+    {
+      pthread_mutex_unlock(locks[l]);
+    }
+  }
+
+  size_t bytes = 0;
+  for (int i = 0, end; i < count; i = end)
+  {
+    char *path = batch[i]->path;
+    for (end = i; end < count && strcmp(batch[end]->path, path) == 0; end++)
+    {
+    }
+    if (errors[i] != 0)
+    {
+      fprintf(stderr, "Asynchronous write to %s failed: %s\n", path, strerror(errors[i]));
+    }
+    if (entries[i] != NULL)
+    {
+      fdCacheRelease(fd_cache, entries[i]);
+      blockCacheDrop(block_cache, path);
+      notifyMetadata(path);
+    }
+    for (int j = i; j < end; j++)
+    {
+      bytes += batch[j]->dataLength;
+      free(batch[j]->path);
+      free(batch[j]->data);
+      free(batch[j]);
+    }
+  }
+  free(iov);
+  free(entries);
+  free(errors);
+  free(sqes);
+  free(locks);
+  return bytes;
+}
+#endif
+
+// Append every queued write for the same file with a single writev, in queue order, then move to the next file.
+// Frees the requests and returns the bytes they carried
+size_t flushWriteBatch(WriteShard *shard, WriteRequest **batch, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    batch[i]->order = i;
+  }
+  qsort(batch, count, sizeof(WriteRequest *), compareWrites);
+  (void)shard; // Only the io_uring build has a ring to use
+#ifdef USE_IO_URING
+  if (shard->ring != NULL)
+  {
+    size_t bytes = flushWriteBatchUring(shard->ring, batch, count);
+    if (bytes != (size_t)-1)
+    {
+      return bytes;
+    }
+  }
+#endif
+
+  struct iovec iov[IOV_MAX];
+  size_t bytes = 0;
+  int i = 0;
+  while (i < count)
+  {
+    char *path = batch[i]->path;
+    int end = i;
+    while (end < count && strcmp(batch[end]->path, path) == 0)
+    {
+      end++;
+    }
+
+    CachedFd *entry = fdCacheOpen(fd_cache, path, FD_CACHE_APPEND);
+    if (entry == NULL)
+    {
+      perror("Failed to open file for asynchronous writing");
+    }
+    else
+    {
+      int fd = entry->fd;
+      int durable = 0;
+      pthread_mutex_t *lock = fileWriteLock(fd);
+      pthread_mutex_lock(lock);
+      for (int j = i; j < end;)
+      {
+        int pieces = 0;
+        for (; j < end && pieces < IOV_MAX; j++, pieces++)
+        {
+          iov[pieces].iov_base = batch[j]->data;
+          iov[pieces].iov_len = batch[j]->dataLength;
+          durable |= batch[j]->durable;
+        }
+        if (writev(fd, iov, pieces) == -1)
+        {
+          perror("Asynchronous write failed");
+        }
+      }
+      pthread_mutex_unlock(lock);
+      blockCacheDrop(block_cache, path);
+      // One sync for the whole batch, nobody is waiting on it
+      if (durable && fdatasync(fd) == -1)
+      {
+        perror("Asynchronous fdatasync failed");
+      }
+      fdCacheRelease(fd_cache, entry);
+      notifyMetadata(path);
+    }
+    for (int j = i; j < end; j++)
+    {
+      bytes += batch[j]->dataLength;
+      free(batch[j]->path);
+      free(batch[j]->data);
+      free(batch[j]);
+    }
+    i = end;
+  }
+  return bytes;
 }
 
+// Write-behind thread of one shard: the client was acked when its write was queued and its connection is gone by now
 void *processWriteRequests(void *arg)
 {
+  WriteShard *shard = (WriteShard *)arg;
+  int capacity = 64;
+  WriteRequest **batch = malloc(capacity * sizeof(WriteRequest *));
+  if (batch == NULL)
+  {
+    perror("Write batch allocation failed");
+    exit(EXIT_FAILURE);
+  }
+#ifdef USE_IO_URING
+  shard->ring = malloc(sizeof(Uring));
+  if (shard->ring != NULL && uringInit(shard->ring, URING_DEPTH, 0) == -1)
+  {
+    perror("io_uring setup failed, writing with writev");
+    free(shard->ring);
+    shard->ring = NULL;
+  }
+#endif
+  WriteRequest *request = NULL;
   while (1)
   {
-    WriteRequest *request = removeHighestPriorityRequest(pq);
-    if (request)
+    if (request == NULL)
     {
-      FILE *file = fopen(request->path, "a");
-      if (!file)
+      request = takeWriteBatch(shard);
+    }
+    int count = 0;
+    for (; request != NULL; request = request->next)
+    {
+      if (count == capacity)
       {
-        sendErrorMessage(request->socket, 2);
-        free(request->path);
-        free(request->data);
-        free(request);
-        continue;
+        WriteRequest **larger = realloc(batch, capacity * 2 * sizeof(WriteRequest *));
+        if (larger == NULL)
+        {
+          break; // Write what fits, the rest follows in the next round in the same order
+        }
+        batch = larger;
+        capacity *= 2;
       }
-      fwrite(request->data, sizeof(char), request->dataLength, file);
-      fclose(file);
-      sendack(request->socket, "Asynchronous write completed successfully.");
-      free(request->path);
-      free(request->data);
-      free(request);
+      batch[count++] = request;
     }
-    else
+
+    size_t written = flushWriteBatch(shard, batch, count);
+    size_t before = atomic_fetch_sub(&shard->bytes, written);
+    if (before >= write_backlog && atomic_load(&shard->blocked) > 0)
     {
-      usleep(100000);
+      pthread_mutex_lock(&shard->lock);
+      pthread_cond_broadcast(&shard->room);
+      pthread_mutex_unlock(&shard->lock);
     }
   }
+  return NULL;
+}
+
+static void startWriteShards()
+{
+  shard_count = write_shards > 0 ? write_shards : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (shard_count < 1)
+  {
+    shard_count = 1;
+  }
+  if (shard_count > WRITE_MAX_SHARDS)
+  {
+    shard_count = WRITE_MAX_SHARDS;
+  }
+  shards = calloc(shard_count, sizeof(WriteShard));
+  for (int i = 0; i < shard_count; i++)
+  {
+    pthread_mutex_init(&shards[i].lock, NULL);
+    pthread_cond_init(&shards[i].wake, NULL);
+    pthread_cond_init(&shards[i].room, NULL);
+    pthread_t writer;
+    pthread_create(&writer, NULL, processWriteRequests, &shards[i]);
+    pthread_detach(writer);
+  }
 }
 
-void *writeFileThread(void *arg)
+// Apply a WRITE here: appended and acknowledged by the disk as its durability asks, or queued for the shard's
+// writer. Returns WRITE_APPLIED, or WRITE_OPEN_FAILED, WRITE_FAILED or WRITE_NO_MEMORY
+int applyWrite(const char *path, const char *data, int syncFlag)
 {
-  WriteRequest *request = (WriteRequest *)arg;
-  FILE *file = fopen(request->path, "a");
-  if (!file)
+  static pthread_once_t writersStarted = PTHREAD_ONCE_INIT;
+  pthread_once(&writersStarted, startWriteShards);
+  // Bits above WRITE_SYNC pick the durability, none of them means the server's default
+  int level = syncFlag >> WRITE_DURABILITY_SHIFT;
+  level = level > 0 && level <= DURABILITY_DSYNC + 1 ? level - 1 : durability;
+  if (syncFlag & WRITE_SYNC)
+  {
+    // O_DSYNC descriptors are not shared, the cache hands out plain appending ones
+    CachedFd *entry = NULL;
+    int fd = level == DURABILITY_DSYNC ? open(path, O_WRONLY | O_APPEND | O_CREAT | O_DSYNC, 0666) : -1;
+    if (level != DURABILITY_DSYNC && (entry = fdCacheOpen(fd_cache, path, FD_CACHE_APPEND)) != NULL)
+    {
+      fd = entry->fd;
+    }
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+      if (entry != NULL)
+      {
+        fdCacheRelease(fd_cache, entry);
+      }
+      else if (fd != -1)
+      {
+        close(fd);
+      }
+      return WRITE_OPEN_FAILED;
+    }
+    WriteStripe *stripe = fileWriteStripe(&st);
+    pthread_mutex_lock(&stripe->lock);
+    int written = writeAllData(fd, data, strlen(data));
+    blockCacheDrop(block_cache, path);
+    if (written == 0 && level == DURABILITY_GROUP)
+    {
+      written = waitDurable(stripe, fd, &st);
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    if (entry != NULL)
+    {
+      fdCacheRelease(fd_cache, entry);
+    }
+    else
+    {
+      close(fd);
+    }
+    notifyMetadata(path);
+    return written == 0 ? WRITE_APPLIED : WRITE_FAILED;
+  }
+
+  WriteRequest *request = malloc(sizeof(WriteRequest));
+  if (!request)
+  {
+    return WRITE_NO_MEMORY;
+  }
+  request->path = strdup(path);
+  request->data = strdup(data);
+  request->dataLength = strlen(data);
+  request->durable = level != DURABILITY_NONE;
+  if (!request->path || !request->data)
   {
-    sendErrorMessage(request->socket, 2);
     free(request->path);
     free(request->data);
     free(request);
-    return NULL;
-  }
-  size_t totalDataLength = request->dataLength;
-  size_t writtenBytes = 0;
-  char buffer[BUFFER_SIZE];
-  size_t bufferOffset = 0;
-  while (writtenBytes < totalDataLength)
-  {
-    size_t bytesToWrite = (totalDataLength - writtenBytes > BUFFER_SIZE) ? BUFFER_SIZE : (totalDataLength - writtenBytes);
-    memcpy(buffer + bufferOffset, request->data + writtenBytes, bytesToWrite);
-    bufferOffset += bytesToWrite;
-    writtenBytes += bytesToWrite;
-    size_t result = fwrite(buffer, sizeof(char), bufferOffset, file);
-    if (result < bufferOffset)
-    {
-      perror("Partial write error");
+    return WRITE_NO_MEMORY;
+  }
+  pushWriteRequest(shardFor(path), request);
+  return WRITE_APPLIED;
+}
+
+// The acknowledgment a client gets for a WRITE that applyWrite returned result for
+const char *writeAckMessage(int syncFlag, int result)
+{
+  switch (result)
+  {
+  case WRITE_APPLIED:
+    return (syncFlag & WRITE_SYNC) ? "Synchronous write completed successfully." : "Asynchronously writing data to file";
+  case WRITE_OPEN_FAILED:
+    return "Failed to open file for synchronous writing.";
+  case WRITE_NO_MEMORY:
+    return "Memory allocation failed.";
+  default:
+    return "Synchronous write failed.";
+  }
+}
+
+int writeFile_with_sync_and_async(const char *path, int socket, const char *data, int syncFlag)
+{
+  int result = applyWrite(path, data, syncFlag);
+  sendack(socket, writeAckMessage(syncFlag, result));
+  if (syncFlag & WRITE_SYNC)
+  {
+    return 1; // Return appropriate status
+  }
+  return result == WRITE_NO_MEMORY ? -1 : 0;
+}
+
+char *get_ip_address()
+{
+  static char ip_address[INET_ADDRSTRLEN];
+  struct ifaddrs *ifaddr, *ifa;
+  int family, s;
+
+  // Get a list of all interfaces
+  if (getifaddrs(&ifaddr) == -1)
+  {
+    perror("getifaddrs");
+    exit(EXIT_FAILURE);
+  }
+
+  for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+  {
+    if (ifa->ifa_addr == NULL)
+      continue;
+
+    family = ifa->ifa_addr->sa_family;
+
+    // Only look at IPv4 addresses
+    if (family == AF_INET)
+    {
+      s = getnameinfo(ifa->ifa_addr, sizeof(struct sockaddr_in),
+                      ip_address, sizeof(ip_address),
+                      NULL, 0, NI_NUMERICHOST);
+      if (s != 0)
+      {
+        printf("getnameinfo() failed: %s\n", gai_strerror(s));
+        exit(EXIT_FAILURE);
+      }
+
+      // Avoid loopback address
+      if (strcmp(ifa->ifa_name, "lo") != 0)
+      {
+        break;
+      }
+    }
+  }
+
+  // Free the list of interfaces
+  freeifaddrs(ifaddr);
+
+  return ip_address;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII~~~metadata notifications~~~IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII
+
+int nm_notify_sock = -1;
+size_t stream_chunk = STREAM_CHUNK_DEFAULT;
+static pthread_mutex_t notifyLock = PTHREAD_MUTEX_INITIALIZER;
+
+void fillMetaRecord(const char *path, MetaRecord *record)
+{
+  struct stat st;
+  memset(record, 0, sizeof(MetaRecord));
+
+  // Paths reach us as home_directory + "/" + path, the naming server knows them without the extra slash
+  while (path[0] == '/' && path[1] == '/')
+  {
+    path++;
+  }
+  strncpy(record->path, path, sizeof(record->path) - 1);
+
+  if (stat(path, &st) == -1)
+  {
+    record->kind = (errno == ENOENT) ? 'D' : 'E';
+    return;
+  }
+  record->kind = 'U';
+  record->size = (long long)st.st_size;
+  record->mode = st.st_mode;
+  record->atime = (long long)st.st_atime;
+  record->mtime = (long long)st.st_mtime;
+  record->ctime = (long long)st.st_ctime;
+}
+
+// Tell the naming server the path changed so it can answer GET_INFO without asking us
+void notifyMetadata(const char *path)
+{
+  if (nm_notify_sock < 0)
+  {
+    return;
+  }
+  MetaRecord record;
+  fillMetaRecord(path, &record);
+
+  pthread_mutex_lock(&notifyLock);
+  if (send(nm_notify_sock, &record, sizeof(record), MSG_NOSIGNAL) != sizeof(record))
+  {
+    perror("Error sending metadata notification");
+  }
+  pthread_mutex_unlock(&notifyLock);
+}
+
+// A chain head could not pass a write on: its copy of path is now the only current one, the naming server takes
+// the path off the other replicas until they are brought up to date
+void notifyLaggingReplicas(const char *path)
+{
+  if (nm_notify_sock < 0)
+  {
+    return;
+  }
+  MetaRecord record;
+  fillMetaRecord(path, &record);
+  record.kind = 'L';
+
+  pthread_mutex_lock(&notifyLock);
+  if (send(nm_notify_sock, &record, sizeof(record), MSG_NOSIGNAL) != sizeof(record))
+  {
+    perror("Error sending lagging replica notification");
+  }
+  pthread_mutex_unlock(&notifyLock);
+}
+
+// STAT: answer a naming server cache miss with one MetaRecord
+int sendMetaRecord(const char *path, int socket)
+{
+  MetaRecord record;
+  fillMetaRecord(path, &record);
+  return send(socket, &record, sizeof(record), 0) == sizeof(record) ? 0 : -1;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII~~~storage server to storage server transfers~~~IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII
+
+#define TRANSFER_CHUNK (64 * 1024)
+#define SENDFILE_MAX 0x7ffff000 // Most the kernel moves in one sendfile call
+
+// Send length bytes of fd starting at offset straight from the page cache, falling back to read/send where
+// sendfile is not supported. Returns the number of bytes sent
+#ifdef USE_IO_URING
+UringPool *uring_pool;
+
+#define URING_READ 0
+#define URING_SEND 1
+
+// sendFileRange on io_uring: reads into the ring's registered buffers from its registered file run up to
+// URING_BUFFERS chunks ahead of the socket, which gets one send at a time so the bytes leave in order. Returns the
+// bytes sent, or -2 if the file could not be registered and the caller should fall back
+static long long uringSendFileRange(int fd, long long offset, long long length, int socket)
+{
+  Uring *ring = uringBorrow(uring_pool);
+  if (uringSetFile(ring, fd) == -1)
+  {
+    uringReturn(uring_pool, ring);
+    return -2;
+  }
+
+  long long chunks = (length + URING_BUFFER_SIZE - 1) / URING_BUFFER_SIZE;
+  long long issued = 0, done = 0, sent = 0;
+  long long ready[URING_BUFFERS]; // Bytes read into each buffer, -1 while its read is in flight
+  size_t partial = 0;             // Bytes of chunk done already sent
+  int sending = 0, failed = 0;
+  unsigned inflight = 0;
+  struct io_uring_cqe cqe;
+
+  while (!failed && done < chunks)
+  {
+    struct io_uring_sqe *sqe;
+    while (issued < chunks && issued - done < URING_BUFFERS && (sqe = uringGetSqe(ring)) != NULL)
+    {
+      int slot = issued % URING_BUFFERS;
+      long long at = issued * URING_BUFFER_SIZE;
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->flags = IOSQE_FIXED_FILE;
+      sqe->fd = 0;
+      sqe->addr = (unsigned long)(ring->buffers + (size_t)slot * URING_BUFFER_SIZE);
+      sqe->len = length - at < URING_BUFFER_SIZE ? (unsigned)(length - at) : URING_BUFFER_SIZE;
+      sqe->off = offset + at;
+      sqe->buf_index = slot;
+      sqe->user_data = (unsigned long long)issued << 1 | URING_READ;
+      ready[slot] = -1;
+      issued++;
+      inflight++;
+    }
+    int slot = done % URING_BUFFERS;
+    if (!sending && ready[slot] >= 0 && (sqe = uringGetSqe(ring)) != NULL)
+    {
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = socket;
+      sqe->addr = (unsigned long)(ring->buffers + (size_t)slot * URING_BUFFER_SIZE + partial);
+      sqe->len = (unsigned)(ready[slot] - partial);
+      sqe->msg_flags = MSG_NOSIGNAL;
+      sqe->user_data = (unsigned long long)done << 1 | URING_SEND;
+      sending = 1;
+      inflight++;
+    }
+
+    if (uringSubmit(ring, 1) < 0 && errno != EAGAIN && errno != EBUSY)
+    {
+      failed = 1;
       break;
     }
-    bufferOffset = 0;
-    usleep(100000);
+    while (uringPeekCqe(ring, &cqe))
+    {
+      inflight--;
+      long long chunk = (long long)(cqe.user_data >> 1);
+      if ((cqe.user_data & 1) == URING_READ)
+      {
+        long long want = length - chunk * URING_BUFFER_SIZE < URING_BUFFER_SIZE ? length - chunk * URING_BUFFER_SIZE : URING_BUFFER_SIZE;
+        failed |= cqe.res != want; // Error, or the file shrank under us
+        ready[chunk % URING_BUFFERS] = cqe.res;
+        continue;
+      }
+      sending = 0;
+      if (cqe.res <= 0)
+      {
+        failed = 1;
+        continue;
+      }
+      sent += cqe.res;
+      partial += cqe.res;
+      if ((long long)partial == ready[slot])
+      {
+        ready[slot] = -1;
+        partial = 0;
+        done++;
+      }
+    }
   }
-  fclose(file);
-  sendack(request->socket, "Write completed successfully");
-  free(request->path);
-  free(request->data);
-  free(request);
-  return NULL;
+
+  // The buffers belong to the ring, let whatever is still in flight land before handing it back
+  while (inflight > 0 && uringSubmit(ring, 1) >= 0)
+  {
+    while (uringPeekCqe(ring, &cqe))
+    {
+      inflight--;
+    }
+  }
+  uringSetFile(ring, -1);
+  uringReturn(uring_pool, ring);
+  return sent;
 }
+#endif
 
-int writeFile_with_sync_and_async(const char *path, int socket, const char *data, int syncFlag)
+long long sendFileRange(int fd, long long offset, long long length, int socket)
 {
-  static pthread_mutex_t syncWriteLock = PTHREAD_MUTEX_INITIALIZER;
-  static int isInitialized = 0;
-  if (!isInitialized)
+#ifdef USE_IO_URING
+  if (uring_pool != NULL && length > 0)
   {
-    pq = createPriorityQueue();
-    pthread_t workerThread;
-    pthread_create(&workerThread, NULL, processWriteRequests, NULL);
-    pthread_detach(workerThread);
-    isInitialized = 1;
+    long long sent = uringSendFileRange(fd, offset, length, socket);
+    if (sent != -2)
+    {
+      return sent;
+    }
   }
-  if (syncFlag)
+#endif
+  long long sent = 0;
+  off_t position = (off_t)offset;
+  while (sent < length)
   {
-    pthread_mutex_lock(&syncWriteLock);
-    FILE *file = fopen(path, "a");
-    if (file)
+    size_t want = (length - sent) > SENDFILE_MAX ? SENDFILE_MAX : (size_t)(length - sent);
+    ssize_t n = sendfile(socket, fd, &position, want);
+    if (n == -1 && errno == EINTR)
     {
-      fwrite(data, sizeof(char), strlen(data), file);
-      fclose(file);
-      sendack(socket, "Synchronous write completed successfully.");
+      continue;
     }
-    else
+    if (n == -1 && (errno == EINVAL || errno == ENOSYS) && sent == 0)
     {
-      sendack(socket, "Failed to open file for synchronous writing.");
+      break; // Fall back below
     }
-    pthread_mutex_unlock(&syncWriteLock);
-    return 1; // Return appropriate status
+    if (n <= 0)
+    {
+      return sent;
+    }
+    sent += n;
   }
-  else
+  if (sent == length)
   {
-    WriteRequest *request = malloc(sizeof(WriteRequest));
-    if (!request)
+    return sent;
+  }
+
+  char *buffer = malloc(TRANSFER_CHUNK);
+  while (buffer && sent < length)
+  {
+    size_t want = (length - sent) > TRANSFER_CHUNK ? TRANSFER_CHUNK : (size_t)(length - sent);
+    ssize_t bytesRead = pread(fd, buffer, want, (off_t)(offset + sent));
+    if (bytesRead <= 0 || send(socket, buffer, bytesRead, 0) != bytesRead)
     {
-      sendack(socket, "Memory allocation failed.");
-      return -1;
+      break;
+    }
+    sent += bytesRead;
+  }
+  free(buffer);
+  return sent;
+}
+
+// Serve a file to a peer from offset on: a long long length header (-1 on error, TRANSFER_IS_DIR for a directory)
+// then the bytes
+int sendWholeFile(const char *path, long long offset, int socket)
+{
+  struct stat st;
+  long long length = -1;
+  CachedFd *entry = fdCacheOpen(fd_cache, path, FD_CACHE_READ);
+
+  if (entry != NULL && fstat(entry->fd, &st) == 0 && S_ISDIR(st.st_mode))
+  {
+    length = TRANSFER_IS_DIR;
+  }
+  else if (entry != NULL && fstat(entry->fd, &st) == 0 && offset >= 0)
+  {
+    length = offset < (long long)st.st_size ? (long long)st.st_size - offset : 0;
+  }
+
+  if (send(socket, &length, sizeof(length), 0) != sizeof(length) || length < 0)
+  {
+    fdCacheRelease(fd_cache, entry);
+    return length == TRANSFER_IS_DIR ? 0 : -1;
+  }
+
+  long long sent = sendFileRange(entry->fd, offset, length, socket);
+  fdCacheRelease(fd_cache, entry);
+  return sent == length ? 0 : -1;
+}
+
+// Create a temporary file next to path for it to be renamed over path later. The name is unique to this process
+// and call, so concurrent UPLOADs or PULLs of the same path never write into each other's file. It gets the mode
+// of the file it will replace, so replacing a file keeps its permissions
+static int openTempFile(const char *path, const char *kind, char *temp_path, size_t size)
+{
+  static atomic_uint next_temp;
+  int length = snprintf(temp_path, size, "%s.%s.%d.%u", path, kind, (int)getpid(), atomic_fetch_add(&next_temp, 1));
+  int fd = length >= 0 && (size_t)length < size ? open(temp_path, O_CREAT | O_EXCL | O_WRONLY, 0666) : -1;
+  struct stat st;
+  if (fd != -1 && stat(path, &st) == 0 && fchmod(fd, st.st_mode & 07777) == -1)
+  {
+    close(fd);
+    unlink(temp_path);
+    fd = -1;
+  }
+  if (fd == -1)
+  {
+    temp_path[0] = '\0'; // Not ours, the callers' cleanup must not unlink it
+  }
+  return fd;
+}
+
+#define UPLOAD_BUFFERS 8                // Buffers gathered into one pwritev
+#define UPLOAD_BUFFER_SIZE (256 * 1024)
+
+// Receive an UPLOAD body: chunks of a long long length header followed by that many bytes, ended by a zero length.
+// The bytes are gathered into UPLOAD_BUFFERS buffers and written with one pwritev whenever all of them are full,
+// into a temporary file that replaces path once the last chunk arrived. A failed write keeps draining the chunks
+// so the connection can still carry the error ack. Returns the number of bytes stored, -1 on failure
+long long receiveUpload(const char *path, int socket)
+{
+  char temp_path[PATH_MAX];
+  int fd = openTempFile(path, "upload", temp_path, sizeof(temp_path));
+
+  struct iovec iov[UPLOAD_BUFFERS];
+  char *buffers = malloc((size_t)UPLOAD_BUFFERS * UPLOAD_BUFFER_SIZE);
+  int failed = fd == -1 || buffers == NULL;
+  int used = 0;       // Buffers holding data, the last one possibly partly
+  size_t filled = 0;  // Bytes in the last buffer
+  long long offset = 0, total = 0;
+
+  while (1)
+  {
+    long long length;
+    if (recvAll(socket, &length, sizeof(length)) == -1 || length < 0)
+    {
+      failed = 2; // The stream itself broke, nothing more to drain
+      break;
+    }
+    if (length == 0)
+    {
+      break;
+    }
+    while (length > 0)
+    {
+      char drain[4096];
+      char *target = drain;
+      size_t room = sizeof(drain);
+      if (!failed)
+      {
+        if (used == 0 || filled == UPLOAD_BUFFER_SIZE)
+        {
+          iov[used].iov_base = buffers + (size_t)used * UPLOAD_BUFFER_SIZE;
+          iov[used].iov_len = 0;
+          used++;
+          filled = 0;
+        }
+        target = (char *)iov[used - 1].iov_base + filled;
+        room = UPLOAD_BUFFER_SIZE - filled;
+      }
+      ssize_t n = recv(socket, target, (size_t)length < room ? (size_t)length : room, 0);
+      if (n <= 0)
+      {
+        failed = 2;
+        break;
+      }
+      length -= n;
+      total += n;
+      if (failed)
+      {
+        continue;
+      }
+      filled += n;
+      iov[used - 1].iov_len = filled;
+      if (used == UPLOAD_BUFFERS && filled == UPLOAD_BUFFER_SIZE)
+      {
+        // All buffers full, one vectored write for the lot
+        if (pwritev(fd, iov, used, offset) != (ssize_t)UPLOAD_BUFFERS * UPLOAD_BUFFER_SIZE)
+        {
+          failed = 1;
+        }
+        offset += (long long)UPLOAD_BUFFERS * UPLOAD_BUFFER_SIZE;
+        used = 0;
+      }
     }
-    request->path = strdup(path);
-    request->data = strdup(data);
-    request->socket = socket;
-    request->dataLength = strlen(data);
-    request->priority = 2;
-    if (!request->path || !request->data)
+    if (failed == 2)
     {
-      free(request->path);
-      free(request->data);
-      free(request);
-      sendack(socket, "Memory allocation failed.");
-      return -2;
+      break;
     }
-    insertRequest(pq, request);
-    sendack(socket, "Asynchronously writing data to file");
   }
-  return 0;
+
+  if (!failed && used > 0)
+  {
+    ssize_t expected = (ssize_t)(used - 1) * UPLOAD_BUFFER_SIZE + filled;
+    if (pwritev(fd, iov, used, offset) != expected)
+    {
+      failed = 1;
+    }
+  }
+  free(buffers);
+  if (fd != -1 && close(fd) != 0)
+  {
+    failed = 1;
+  }
+  if (failed || rename(temp_path, path) == -1)
+  {
+    unlink(temp_path);
+    return -1;
+  }
+  invalidatePath(path); // Cached descriptors and contents are of the replaced file
+  return total;
 }
 
-char *get_ip_address()
+// Receive what sendWholeFile sent into path, written to a temporary file and renamed into place when complete
+int receiveWholeFile(const char *path, int socket)
 {
-  static char ip_address[INET_ADDRSTRLEN];
-  struct ifaddrs *ifaddr, *ifa;
-  int family, s;
-
-  // Get a list of all interfaces
-  if (getifaddrs(&ifaddr) == -1)
+  long long length;
+  if (recvAll(socket, &length, sizeof(length)) == -1)
   {
-    perror("getifaddrs");
-    exit(EXIT_FAILURE);
+    return -1;
   }
-
-  for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+  if (length == TRANSFER_IS_DIR)
   {
-    if (ifa->ifa_addr == NULL)
-      continue;
+    makeParentDirs(path);
+    return (mkdir(path, 0777) == 0 || errno == EEXIST) ? 0 : -1;
+  }
+  if (length < 0 || makeParentDirs(path) == -1)
+  {
+    return -1;
+  }
 
-    family = ifa->ifa_addr->sa_family;
+  char temp_path[PATH_MAX];
+  int fd = openTempFile(path, "pull", temp_path, sizeof(temp_path));
+  if (fd == -1)
+  {
+    return -1;
+  }
 
-    // Only look at IPv4 addresses
-    if (family == AF_INET)
+  char *buffer = malloc(TRANSFER_CHUNK);
+  long long received = 0;
+  while (buffer && received < length)
+  {
+    size_t want = (length - received) > TRANSFER_CHUNK ? TRANSFER_CHUNK : (size_t)(length - received);
+    ssize_t n = recv(socket, buffer, want, 0);
+    if (n <= 0 || write(fd, buffer, n) != n)
     {
-      s = getnameinfo(ifa->ifa_addr, sizeof(struct sockaddr_in),
-                      ip_address, sizeof(ip_address),
-                      NULL, 0, NI_NUMERICHOST);
-      if (s != 0)
-      {
-        printf("getnameinfo() failed: %s\n", gai_strerror(s));
-        exit(EXIT_FAILURE);
-      }
-
-      // Avoid loopback address
-      if (strcmp(ifa->ifa_name, "lo") != 0)
-      {
-        break;
-      }
+      break;
     }
+    received += n;
   }
+  free(buffer);
+  close(fd);
 
-  // Free the list of interfaces
-  freeifaddrs(ifaddr);
-
-  return ip_address;
+  if (received != length || rename(temp_path, path) == -1)
+  {
+    unlink(temp_path);
+    return -1;
+  }
+  invalidatePath(path); // Cached descriptors and contents are of the replaced file
+  return 0;
 }
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -451,11 +1506,15 @@ int deleteFileOrDirectory(int sock, const char *path)
 
   if (S_ISDIR(path_stat.st_mode))
   {
-    return deleteDirectoryRecursively(sock, path); // Pass sock to deleteDirectoryRecursively
+    int result = deleteDirectoryRecursively(sock, path); // Pass sock to deleteDirectoryRecursively
+    invalidatePath(path);
+    return result;
   }
   else if (S_ISREG(path_stat.st_mode))
   {
-    if (unlink(path) == -1)
+    int removed = unlink(path);
+    invalidatePath(path); // Only after the unlink, or a reader could cache the doomed file again
+    if (removed == -1)
     {
       sendErrorMessage(sock, ERR_CREATING_FILE); // Send error message for error deleting the file
       return ERR_CREATING_FILE;                  // Error deleting the file
@@ -473,6 +1532,94 @@ int deleteFileOrDirectory(int sock, const char *path)
   }
 }
 
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+// Copy the contents of src_fd into dst_fd without moving bytes through user space where the kernel allows it:
+// a reflink shares the source's extents (near-instant on btrfs, XFS and the like), copy_file_range copies in
+// the kernel (server-side on NFS and similar), sendfile copies page cache to page cache, and a large buffer
+// loop is the last resort. Each step falls through only if it could not copy anything yet
+int copyFileData(int src_fd, int dst_fd)
+{
+  if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+  {
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(src_fd, &st) != 0)
+  {
+    return -1;
+  }
+  long long remaining = (long long)st.st_size;
+  int first = 1;
+  while (remaining > 0)
+  {
+    ssize_t copied = copy_file_range(src_fd, NULL, dst_fd, NULL, remaining > SENDFILE_MAX ? SENDFILE_MAX : (size_t)remaining, 0);
+    if (copied == -1 && errno == EINTR)
+    {
+      continue;
+    }
+    if (copied == -1 && first && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+    {
+      break; // Try sendfile below
+    }
+    if (copied == -1)
+    {
+      return -1;
+    }
+    if (copied == 0)
+    {
+      return 0; // The source shrank
+    }
+    remaining -= copied;
+    first = 0;
+  }
+  if (remaining <= 0)
+  {
+    return 0;
+  }
+
+  while (remaining > 0)
+  {
+    ssize_t copied = sendfile(dst_fd, src_fd, NULL, remaining > SENDFILE_MAX ? SENDFILE_MAX : (size_t)remaining);
+    if (copied == -1 && errno == EINTR)
+    {
+      continue;
+    }
+    if (copied == -1 && first && (errno == EINVAL || errno == ENOSYS))
+    {
+      break; // Fall back to the buffer loop
+    }
+    if (copied <= 0)
+    {
+      return copied == 0 ? 0 : -1;
+    }
+    remaining -= copied;
+    first = 0;
+  }
+  if (remaining <= 0)
+  {
+    return 0;
+  }
+
+  char *buffer = malloc(COPY_BUFFER_SIZE);
+  if (buffer == NULL)
+  {
+    return -1;
+  }
+  ssize_t bytes_read;
+  while ((bytes_read = read(src_fd, buffer, COPY_BUFFER_SIZE)) > 0)
+  {
+    if (write(dst_fd, buffer, bytes_read) != bytes_read)
+    {
+      free(buffer);
+      return -1;
+    }
+  }
+  free(buffer);
+  return bytes_read == 0 ? 0 : -1;
+}
+
 int copyFile(const char *src, const char *dst, int socket)
 {
   int src_fd = open(src, O_RDONLY);
@@ -491,25 +1638,13 @@ int copyFile(const char *src, const char *dst, int socket)
     return -2;
   }
 
-  char buffer[1024];
-  ssize_t bytes_read;
-  while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0)
-  {
-    ssize_t bytes_written = write(dst_fd, buffer, bytes_read);
-    if (bytes_written != bytes_read)
-    {
-      perror("Error writing to destination file");
-      sendack(socket, "Error occurred while writing to the destination file.");
-      close(src_fd);
-      close(dst_fd);
-      return -3;
-    }
-  }
-
-  if (bytes_read == -1)
+  if (copyFileData(src_fd, dst_fd) != 0)
   {
-    perror("Error reading source file");
-    sendack(socket, "Error occurred while reading the source file.");
+    perror("Error copying to destination file");
+    sendack(socket, "Error occurred while writing to the destination file.");
+    close(src_fd);
+    close(dst_fd);
+    return -3;
   }
   close(src_fd);
   close(dst_fd);
@@ -517,81 +1652,311 @@ int copyFile(const char *src, const char *dst, int socket)
   return 0;
 }
 
-int copyDirectory(const char *src, const char *dst, int socket)
+int copy_workers = 0;
+
+// Directory open for a tree copy, shared by the file jobs inside it and closed when the last one is done
+typedef struct
 {
-  DIR *dir = opendir(src);
-  if (dir == NULL)
+  int fd;
+  int refs;
+} CopyDir;
+
+typedef struct CopyJob
+{
+  struct CopyJob *next;
+  CopyDir *src_dir;
+  CopyDir *dst_dir;
+  long long size;
+  char name[256];
+} CopyJob;
+
+// One tree copy: the producer walks the source and queues files, the workers copy them
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  CopyJob *head;
+  CopyJob *tail;
+  int queued;
+  int done;            // The producer has queued everything
+  long long files;
+  long long dirs;
+  long long bytes;
+  long long failures;
+  char first_error[512];
+} TreeCopy;
+
+static void releaseCopyDir(TreeCopy *copy, CopyDir *dir)
+{
+  pthread_mutex_lock(&copy->lock);
+  int last = --dir->refs == 0;
+  pthread_mutex_unlock(&copy->lock);
+  if (last)
   {
-    perror("Error opening source directory");
-    sendack(socket, "Unable to open the source directory.");
-    return -1;
+    close(dir->fd);
+    free(dir);
   }
+}
+
+static void treeCopyFailed(TreeCopy *copy, const char *name, const char *what)
+{
+  pthread_mutex_lock(&copy->lock);
+  if (copy->failures++ == 0)
+  {
+    snprintf(copy->first_error, sizeof(copy->first_error), "%s %s: %s", what, name, strerror(errno));
+  }
+  pthread_mutex_unlock(&copy->lock);
+}
 
-  // Create destination directory
-  if (mkdir(dst, 0777) == -1)
+static void *treeCopyWorker(void *arg)
+{
+  TreeCopy *copy = (TreeCopy *)arg;
+  while (1)
   {
-    // If the directory exists, check if it's a directory
-    struct stat dst_stat;
-    if (stat(dst, &dst_stat) == 0 && S_ISDIR(dst_stat.st_mode))
+    pthread_mutex_lock(&copy->lock);
+    while (copy->head == NULL && !copy->done)
     {
-      // Directory already exists, proceed
+      pthread_cond_wait(&copy->not_empty, &copy->lock);
+    }
+    CopyJob *job = copy->head;
+    if (job == NULL)
+    {
+      pthread_mutex_unlock(&copy->lock);
+      return NULL;
+    }
+    copy->head = job->next;
+    if (copy->head == NULL)
+    {
+      copy->tail = NULL;
+    }
+    copy->queued--;
+    pthread_cond_signal(&copy->not_full);
+    pthread_mutex_unlock(&copy->lock);
+
+    int src_fd = openat(job->src_dir->fd, job->name, O_RDONLY | O_NOFOLLOW);
+    int dst_fd = src_fd == -1 ? -1 : openat(job->dst_dir->fd, job->name, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (src_fd == -1 || dst_fd == -1)
+    {
+      treeCopyFailed(copy, job->name, "open");
+    }
+    else if (copyFileData(src_fd, dst_fd) != 0)
+    {
+      treeCopyFailed(copy, job->name, "copy");
     }
     else
     {
-      perror("Error creating destination directory");
-      sendack(socket, "Unable to create the destination directory.");
-      closedir(dir);
-      return -2;
+      pthread_mutex_lock(&copy->lock);
+      copy->files++;
+      copy->bytes += job->size;
+      pthread_mutex_unlock(&copy->lock);
+    }
+    if (src_fd != -1)
+    {
+      close(src_fd);
+    }
+    if (dst_fd != -1)
+    {
+      close(dst_fd);
     }
+    releaseCopyDir(copy, job->src_dir);
+    releaseCopyDir(copy, job->dst_dir);
+    free(job);
   }
+}
 
-  struct dirent *entry;
-  char src_path[1024], dst_path[1024];
+// Producer: walk one source directory relative to its fd, create subdirectories and queue the files
+static void treeCopyWalk(TreeCopy *copy, CopyDir *src_dir, CopyDir *dst_dir, int queue_limit)
+{
+  int list_fd = dup(src_dir->fd); // fdopendir takes ownership of the fd
+  DIR *dir = list_fd == -1 ? NULL : fdopendir(list_fd);
+  if (dir == NULL)
+  {
+    if (list_fd != -1)
+    {
+      close(list_fd);
+    }
+    treeCopyFailed(copy, ".", "list");
+    return;
+  }
 
-  // Loop through the source directory
+  struct dirent *entry;
   while ((entry = readdir(dir)) != NULL)
   {
-    // Skip . and .. entries
     if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
     {
       continue;
     }
-
-    // Construct source and destination paths
-    snprintf(src_path, sizeof(src_path), "%s/%s", src, entry->d_name);
-    snprintf(dst_path, sizeof(dst_path), "%s/%s", dst, entry->d_name);
-
-    struct stat path_stat;
-    if (stat(src_path, &path_stat) == -1)
+    struct stat st;
+    if (fstatat(src_dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
     {
-      perror("Error stating source file or directory");
-      sendack(socket, "Error occurred while stating the source file or directory.");
-      closedir(dir);
-      return -3;
+      treeCopyFailed(copy, entry->d_name, "stat");
+      continue;
     }
 
-    if (S_ISDIR(path_stat.st_mode))
+    if (S_ISDIR(st.st_mode))
     {
-      if (copyDirectory(src_path, dst_path, socket) != 0)
+      if (mkdirat(dst_dir->fd, entry->d_name, 0777) == -1 && errno != EEXIST)
       {
-        closedir(dir);
-        return -4;
+        treeCopyFailed(copy, entry->d_name, "mkdir");
+        continue;
+      }
+      CopyDir *child_src = malloc(sizeof(CopyDir));
+      CopyDir *child_dst = malloc(sizeof(CopyDir));
+      int child_src_fd = openat(src_dir->fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+      int child_dst_fd = openat(dst_dir->fd, entry->d_name, O_RDONLY | O_DIRECTORY);
+      if (child_src == NULL || child_dst == NULL || child_src_fd == -1 || child_dst_fd == -1)
+      {
+        treeCopyFailed(copy, entry->d_name, "open directory");
+        free(child_src);
+        free(child_dst);
+        if (child_src_fd != -1)
+          close(child_src_fd);
+        if (child_dst_fd != -1)
+          close(child_dst_fd);
+        continue;
       }
+      child_src->fd = child_src_fd;
+      child_src->refs = 1;
+      child_dst->fd = child_dst_fd;
+      child_dst->refs = 1;
+      pthread_mutex_lock(&copy->lock);
+      copy->dirs++;
+      pthread_mutex_unlock(&copy->lock);
+
+      treeCopyWalk(copy, child_src, child_dst, queue_limit);
+      releaseCopyDir(copy, child_src);
+      releaseCopyDir(copy, child_dst);
     }
-    // If it's a file, copy the file
-    else if (S_ISREG(path_stat.st_mode))
+    else if (S_ISREG(st.st_mode))
     {
-      if (copyFile(src_path, dst_path, socket) != 0)
+      CopyJob *job = malloc(sizeof(CopyJob));
+      if (job == NULL || strlen(entry->d_name) >= sizeof(job->name))
+      {
+        errno = ENAMETOOLONG;
+        treeCopyFailed(copy, entry->d_name, "queue");
+        free(job);
+        continue;
+      }
+      strcpy(job->name, entry->d_name);
+      job->size = (long long)st.st_size;
+      job->src_dir = src_dir;
+      job->dst_dir = dst_dir;
+      job->next = NULL;
+
+      pthread_mutex_lock(&copy->lock);
+      while (copy->queued >= queue_limit)
       {
-        closedir(dir);
-        return -5;
+        pthread_cond_wait(&copy->not_full, &copy->lock);
       }
+      src_dir->refs++;
+      dst_dir->refs++;
+      if (copy->tail != NULL)
+        copy->tail->next = job;
+      else
+        copy->head = job;
+      copy->tail = job;
+      copy->queued++;
+      pthread_cond_signal(&copy->not_empty);
+      pthread_mutex_unlock(&copy->lock);
     }
   }
-
   closedir(dir);
-  sendack(socket, "Directory copied successfully.");
-  return 0;
+}
+
+// Copy a directory tree: this thread enumerates it with openat/fstatat relative to directory fds while a pool of
+// copy_workers threads copies the files, and the caller gets a single ack with the totals once everything is done
+int copyDirectory(const char *src, const char *dst, int socket)
+{
+  // Create destination directory, an existing one is fine
+  struct stat dst_stat;
+  if (mkdir(dst, 0777) == -1 && !(stat(dst, &dst_stat) == 0 && S_ISDIR(dst_stat.st_mode)))
+  {
+    perror("Error creating destination directory");
+    sendack(socket, "Unable to create the destination directory.");
+    return -2;
+  }
+
+  CopyDir *src_dir = malloc(sizeof(CopyDir));
+  CopyDir *dst_dir = malloc(sizeof(CopyDir));
+  int src_fd = open(src, O_RDONLY | O_DIRECTORY);
+  int dst_fd = open(dst, O_RDONLY | O_DIRECTORY);
+  if (src_dir == NULL || dst_dir == NULL || src_fd == -1 || dst_fd == -1)
+  {
+    perror("Error opening source directory");
+    sendack(socket, "Unable to open the source directory.");
+    free(src_dir);
+    free(dst_dir);
+    if (src_fd != -1)
+      close(src_fd);
+    if (dst_fd != -1)
+      close(dst_fd);
+    return -1;
+  }
+  src_dir->fd = src_fd;
+  src_dir->refs = 1;
+  dst_dir->fd = dst_fd;
+  dst_dir->refs = 1;
+
+  int workers = copy_workers;
+  if (workers <= 0)
+  {
+    workers = (int)sysconf(_SC_NPROCESSORS_ONLN) * 2;
+  }
+  if (workers < 1)
+    workers = 1;
+  if (workers > COPY_MAX_WORKERS)
+    workers = COPY_MAX_WORKERS;
+
+  TreeCopy copy;
+  memset(&copy, 0, sizeof(copy));
+  pthread_mutex_init(&copy.lock, NULL);
+  pthread_cond_init(&copy.not_empty, NULL);
+  pthread_cond_init(&copy.not_full, NULL);
+
+  pthread_t threads[COPY_MAX_WORKERS];
+  int started = 0;
+  while (started < workers && pthread_create(&threads[started], NULL, treeCopyWorker, &copy) == 0)
+  {
+    started++;
+  }
+  if (started == 0)
+  {
+    // No pool, copy on this thread: the walk never blocks on a full queue because the limit is unbounded
+    treeCopyWalk(&copy, src_dir, dst_dir, 1 << 30);
+    copy.done = 1;
+    treeCopyWorker(&copy);
+  }
+  else
+  {
+    treeCopyWalk(&copy, src_dir, dst_dir, started * 4);
+    pthread_mutex_lock(&copy.lock);
+    copy.done = 1;
+    pthread_cond_broadcast(&copy.not_empty);
+    pthread_mutex_unlock(&copy.lock);
+    for (int i = 0; i < started; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+  }
+  releaseCopyDir(&copy, src_dir);
+  releaseCopyDir(&copy, dst_dir);
+  pthread_mutex_destroy(&copy.lock);
+  pthread_cond_destroy(&copy.not_empty);
+  pthread_cond_destroy(&copy.not_full);
+
+  char ack[1024];
+  if (copy.failures == 0)
+  {
+    snprintf(ack, sizeof(ack), "Directory copied successfully: %lld files, %lld directories, %lld bytes.",
+             copy.files, copy.dirs, copy.bytes);
+    sendack(socket, ack);
+    return 0;
+  }
+  snprintf(ack, sizeof(ack), "Directory copy failed: %lld entries failed, %lld files copied (first error: %s).",
+           copy.failures, copy.files, copy.first_error);
+  sendack(socket, ack);
+  return -5;
 }
 
 int copyPath(const char *src, const char *dst, int socket)
@@ -607,14 +1972,19 @@ int copyPath(const char *src, const char *dst, int socket)
   }
 
   // If it's a directory, copy the directory recursively
+  // Whatever was cached under dst is overwritten or replaced
   if (S_ISDIR(path_stat.st_mode))
   {
-    return copyDirectory(src, dst, socket); // Copy directory
+    int result = copyDirectory(src, dst, socket); // Copy directory
+    invalidatePath(dst);
+    return result;
   }
   // If it's a regular file, copy the file
   else if (S_ISREG(path_stat.st_mode))
   {
-    return copyFile(src, dst, socket); // Copy file
+    int result = copyFile(src, dst, socket); // Copy file
+    invalidatePath(dst);
+    return result;
   }
   else
   {
@@ -626,38 +1996,107 @@ int copyPath(const char *src, const char *dst, int socket)
 
 //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%~~client's intractions~~%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
-int readFile(const char *path, int socket)
+// A READ reply for a file held in memory: header, the requested slice and the status in one writev
+static int sendMemoryRange(const char *data, long long size, long long offset, long long length, int socket)
 {
-  printf("inside function for you\n");
+  long long available = offset < 0 ? -1 : offset < size ? size - offset : 0;
+  if (available >= 0 && (length < 0 || length > available))
+  {
+    length = available;
+  }
+  else if (available < 0)
+  {
+    length = -1;
+  }
+  int status = length < 0 ? ERR_OPENING_FILE : SUCCESS;
+
+  struct iovec iov[3] = {
+      {&length, sizeof(length)},
+      {(char *)data + (length > 0 ? offset : 0), length > 0 ? (size_t)length : 0},
+      {&status, sizeof(status)}};
+  int first = 0;
+  while (first < 3)
+  {
+    ssize_t n = writev(socket, iov + first, 3 - first);
+    if (n == -1 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return -3;
+    }
+    for (; first < 3 && (size_t)n >= iov[first].iov_len; first++)
+    {
+      n -= iov[first].iov_len;
+    }
+    if (first < 3)
+    {
+      iov[first].iov_base = (char *)iov[first].iov_base + n;
+      iov[first].iov_len -= n;
+    }
+  }
+  return length < 0 ? -1 : 0;
+}
 
-  int fd = open(path, O_RDONLY);
-  if (fd == -1)
+// READ: a long long length header (-1 if the file cannot be opened or the range is invalid), length bytes
+// starting at offset, then a status code. A negative length reads to the end of the file, and the range is
+// clipped to the file size so the header always announces exactly what follows. Small hot files are answered
+// from the block cache without touching the file
+int readFile(const char *path, long long offset, long long length, int socket)
+{
+  unsigned long generation = 0;
+  CachedBlock *block = blockCacheGet(block_cache, path, &generation);
+  if (block != NULL)
   {
-    sendack(socket, "Error opening source file.");
-    return -1; // Error code indicating failure to open the file
+    int result = sendMemoryRange(block->data, (long long)block->size, offset, length, socket);
+    blockCacheRelease(block_cache, block);
+    return result;
   }
 
-  char response[BUFFER_SIZE];
-  ssize_t bytesRead = read(fd, response, BUFFER_SIZE);
-  if (bytesRead == -1)
+  struct stat st;
+  long long available = -1;
+  CachedFd *entry = fdCacheOpen(fd_cache, path, FD_CACHE_READ);
+  if (entry != NULL && fstat(entry->fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0)
   {
-    sendack(socket, "Error reading from file.");
-    close(fd);
-    return -2; // Error code indicating failure to read the file
+    available = offset < (long long)st.st_size ? (long long)st.st_size - offset : 0;
   }
 
-  // Null-terminate the string to make sure it's a valid C string
-  response[bytesRead] = '\0';
+  // Second miss on a small file: read all of it, keep a copy and answer from memory
+  if (available >= 0 && blockCacheAdmit(block_cache, path, (size_t)st.st_size))
+  {
+    char *contents = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (contents != NULL && pread(entry->fd, contents, st.st_size, 0) == st.st_size)
+    {
+      fdCacheRelease(fd_cache, entry);
+      blockCachePut(block_cache, path, contents, (size_t)st.st_size, generation);
+      int result = sendMemoryRange(contents, (long long)st.st_size, offset, length, socket);
+      free(contents);
+      return result;
+    }
+    free(contents);
+  }
+  if (available >= 0 && (length < 0 || length > available))
+  {
+    length = available;
+  }
+  else if (available < 0)
+  {
+    length = -1;
+  }
 
-  // Close the file after reading
-  close(fd);
+  if (send(socket, &length, sizeof(length), 0) != sizeof(length) || length < 0)
+  {
+    fdCacheRelease(fd_cache, entry);
+    sendErrorCode(socket, ERR_OPENING_FILE);
+    return -1; // Error code indicating failure to open the file
+  }
 
-  // Send the file contents to the client
-  ssize_t bytesSent = send(socket, response, bytesRead, 0);
-  if (bytesSent == -1)
+  long long sent = sendFileRange(entry->fd, offset, length, socket);
+  fdCacheRelease(fd_cache, entry);
+  if (sent != length)
   {
-    sendack(socket, "Error streaming file data.");
-    return -3; // Error code indicating failure to stream the file data
+    return -3; // Error code indicating failure to stream the file data, the client sees the short read
   }
   sendErrorCode(socket, SUCCESS);
   return 0; // Success code
@@ -668,7 +2107,7 @@ int getFileSize(const char *path, int socket)
 
   struct stat st;
 
-  if (stat(path, &st) == -1)
+  if (cachedStat(path, &st) == -1)
   {
     sendack(socket, "Error getting file size.");
     return -1;
@@ -718,7 +2157,7 @@ int getFilePermissions(const char *path, int socket)
   struct stat st;
 
   // Get file status using stat system call
-  if (stat(path, &st) == -1)
+  if (cachedStat(path, &st) == -1)
   {
     sendack(socket, "Error getting file permissions.");
     return -1; // Indicating failure to get permissions
@@ -735,62 +2174,70 @@ int getFilePermissions(const char *path, int socket)
   return 0; // Success
 }
 
+// STREAM: a status code, then the file handed to the socket with sendfile in stream_chunk pieces, then a text
+// ack. The socket stays corked for the whole transfer so the kernel only emits full segments
 int streamAudioFile(const char *path, int socket)
 {
-  // Check if the file exists
-  if (access(path, F_OK) == -1)
+  struct stat st;
+  CachedFd *entry = fdCacheOpen(fd_cache, path, FD_CACHE_READ);
+  if (entry == NULL && errno == ENOENT)
   {
     sendack(socket, "File does not exist.");
     return -1; // Indicating that the file doesn't exist
   }
-
-  int file_fd = open(path, O_RDONLY);
-  if (file_fd < 0)
+  if (entry == NULL || fstat(entry->fd, &st) != 0)
   {
+    fdCacheRelease(fd_cache, entry);
     sendack(socket, "Error opening audio file for streaming.");
     return -2; // Indicating failure to open the file
   }
+  int file_fd = entry->fd;
 
+  int cork = 1;
+  setsockopt(socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
   sendErrorCode(socket, SUCCESS);
 
-  char buffer[BUFFER_SIZE];
-  ssize_t bytesRead;
-
-  // Stream the file data in chunks
-  while ((bytesRead = read(file_fd, buffer, sizeof(buffer))) > 0)
+  long long offset = 0;
+  int status = 0;
+  while (offset < (long long)st.st_size)
   {
-    ssize_t bytesSent = send(socket, buffer, bytesRead, 0);
-    if (bytesSent == -1)
+    long long chunk = (long long)st.st_size - offset;
+    if (chunk > (long long)stream_chunk)
+    {
+      chunk = (long long)stream_chunk;
+    }
+    long long sent = sendFileRange(file_fd, offset, chunk, socket);
+    offset += sent;
+    if (sent == chunk)
     {
-      perror("Error sending audio data");
+      continue;
+    }
 
-      // Handle specific errors
-      if (errno == EPIPE || errno == ECONNRESET)
-      {
-        printf("Client disconnected during audio streaming.\n");
-        break; // Exit the loop on client disconnection
-      }
-      else
-      {
-        sendack(socket, "Error sending audio data to client.");
-        close(file_fd);
-        return -3;
-      }
+    perror("Error sending audio data");
+    // Handle specific errors
+    if (errno == EPIPE || errno == ECONNRESET)
+    {
+      printf("Client disconnected during audio streaming.\n");
+    }
+    else
+    {
+      status = -3;
     }
+    break;
   }
-  close(file_fd);
+  fdCacheRelease(fd_cache, entry);
 
-  if (bytesRead == 0)
+  if (status == 0 && offset == (long long)st.st_size)
   {
     sendack(socket, "Audio file streamed successfully.");
   }
-  else if (bytesRead < 0)
+  else if (status != 0)
   {
-    perror("Error reading from audio file");
-    sendack(socket, "Error reading audio file.");
+    sendack(socket, "Error sending audio data to client.");
   }
-
-  return 0;
+  cork = 0;
+  setsockopt(socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)); // Flush the last partial segment
+  return status;
 }
 
 void send_file_metadata(int socket, const struct FileMetadata *metadata)
@@ -818,7 +2265,7 @@ void get_file_metadata(const char *file_path, struct FileMetadata *metadata, int
 
   printf("Getting file metadata for: %s\n", file_path);
 
-  if (stat(file_path, &file_stat) == -1)
+  if (cachedStat(file_path, &file_stat) == -1)
   {
     perror("stat");
     sendErrorCode(sock, -1); // Send error code if stat fails
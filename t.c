@@ -13,10 +13,39 @@ TrieNode* createTrieNode() {
             node->children[i] = NULL;
         }
         node->server_index = -1;  // No server assigned
+        node->replica_count = 0;
+        node->meta = NULL;
     }
     return node;
 }
 
+// Walk the trie to the node for an exact path, or NULL if the path is not present
+static TrieNode* findTrieNode(TrieNode* root, const char* path) {
+    TrieNode* current = root;
+    for (int i = 0; path[i] != '\0'; i++) {
+        int index = (int)path[i];
+        if (index < 0 || index >= MAX_ASCII || current->children[index] == NULL) {
+            return NULL;
+        }
+        current = current->children[index];
+    }
+    return current;
+}
+
+// Append a server to the node's replica chain unless it is already a member
+static int appendReplica(TrieNode* node, int server_index) {
+    for (int i = 0; i < node->replica_count; i++) {
+        if (node->replicas[i] == server_index) {
+            return 0;  // Already part of the chain
+        }
+    }
+    if (node->replica_count >= MAX_REPLICAS) {
+        return 0;  // Chain is full
+    }
+    node->replicas[node->replica_count++] = server_index;
+    return 1;
+}
+
 // Insert a path into the trie with the given server index
 void insertTrie(TrieNode* root, const char* path, int server_index) {
     TrieNode* current = root;
@@ -31,7 +60,12 @@ void insertTrie(TrieNode* root, const char* path, int server_index) {
         }
         current = current->children[index];
     }
-    current->server_index = server_index;  // Assign storage server index
+    if (current->server_index == -1) {
+        current->server_index = server_index;  // Assign storage server index (head of the chain)
+        current->replica_count = 0;
+    }
+    // A path registered by more than one storage server becomes a replica on each of them
+    appendReplica(current, server_index);
 }
 
 // Search for a path in the trie and return the server index, or -1 if not found
@@ -98,6 +132,7 @@ void freeTrie(TrieNode* root) {
             freeTrie(root->children[i]);
         }
     }
+    free(root->meta);
     free(root);
 }
 
@@ -111,6 +146,9 @@ int deleteTrieHelper(TrieNode* node, const char* path, int depth) {
     if (path[depth] == '\0') {
         if (node->server_index != -1) {
             node->server_index = -1;  // Mark this node as no longer in use
+            node->replica_count = 0;
+            free(node->meta);
+            node->meta = NULL;
             // Check if this node has any children
             for (int i = 0; i < MAX_ASCII; i++) {
                 if (node->children[i] != NULL) {
@@ -144,3 +182,160 @@ int deleteTrieHelper(TrieNode* node, const char* path, int depth) {
 void deleteTrie(TrieNode* root, const char* path) {
     deleteTrieHelper(root, path, 0);
 }
+
+
+// Add a replica for an existing path
+int addTrieReplica(TrieNode* root, const char* path, int server_index) {
+    TrieNode* node = findTrieNode(root, path);
+    if (node == NULL || node->server_index == -1) {
+        return 0;  // Path not found
+    }
+    return appendReplica(node, server_index);
+}
+
+// Copy the replica chain of a path into out, head first
+int getTrieReplicas(TrieNode* root, const char* path, int* out, int max) {
+    TrieNode* node = findTrieNode(root, path);
+    if (node == NULL || node->server_index == -1) {
+        return 0;  // Path not found
+    }
+    int count = node->replica_count < max ? node->replica_count : max;
+    for (int i = 0; i < count; i++) {
+        out[i] = node->replicas[i];
+    }
+    return count;
+}
+
+// Remove a replica from a path's chain, the next replica becomes the head
+void removeTrieReplica(TrieNode* root, const char* path, int server_index) {
+    TrieNode* node = findTrieNode(root, path);
+    if (node == NULL || node->server_index == -1) {
+        return;  // Path not found
+    }
+    int kept = 0;
+    for (int i = 0; i < node->replica_count; i++) {
+        if (node->replicas[i] != server_index) {
+            node->replicas[kept++] = node->replicas[i];
+        }
+    }
+    node->replica_count = kept;
+    if (kept == 0) {
+        deleteTrie(root, path);  // Last copy gone
+    } else {
+        node->server_index = node->replicas[0];
+    }
+}
+
+// Cache metadata for an existing path, NULL drops whatever was cached
+int setTrieMeta(TrieNode* root, const char* path, const PathMeta* meta) {
+    TrieNode* node = findTrieNode(root, path);
+    if (node == NULL || node->server_index == -1) {
+        return 0;  // Only paths we know about get metadata
+    }
+    if (meta == NULL) {
+        free(node->meta);
+        node->meta = NULL;
+        return 1;
+    }
+    if (node->meta == NULL) {
+        node->meta = (PathMeta*)malloc(sizeof(PathMeta));
+        if (node->meta == NULL) {
+            perror("Metadata allocation failed");
+            return 0;
+        }
+    }
+    *node->meta = *meta;
+    return 1;
+}
+
+// Copy the cached metadata of a path, 0 if the path is unknown or nothing is cached yet
+int getTrieMeta(TrieNode* root, const char* path, PathMeta* out) {
+    TrieNode* node = findTrieNode(root, path);
+    if (node == NULL || node->server_index == -1 || node->meta == NULL) {
+        return 0;
+    }
+    *out = *node->meta;
+    return 1;
+}
+
+static void forEachTriePathHelper(TrieNode* node, char* buffer, int depth, void (*visit)(const char*, TrieNode*, void*), void* arg) {
+    if (node->server_index != -1) {
+        buffer[depth] = '\0';
+        visit(buffer, node, arg);
+    }
+    if (depth >= 1023) {
+        return;  // Deeper paths do not fit the buffer
+    }
+    for (int i = 0; i < MAX_ASCII; i++) {
+        if (node->children[i] != NULL) {
+            buffer[depth] = (char)i;
+            forEachTriePathHelper(node->children[i], buffer, depth + 1, visit, arg);
+        }
+    }
+}
+
+// Visit every stored path in lexicographic order
+void forEachTriePath(TrieNode* root, void (*visit)(const char* path, TrieNode* node, void* arg), void* arg) {
+    char buffer[1024];
+    forEachTriePathHelper(root, buffer, 0, visit, arg);
+}
+
+typedef struct {
+    const char* after;    // Cursor, only paths sorting after it are visited
+    int remaining;        // Entries left in this page
+    void (*visit)(const char*, int, void*);
+    void* arg;
+} ListState;
+
+// bounded: the path built so far equals the cursor's first depth characters, so smaller branches can be skipped
+static void listTrieHelper(TrieNode* node, char* buffer, int depth, int bounded, ListState* state) {
+    if (state->remaining == 0) {
+        return;
+    }
+    int at_cursor = bounded && state->after[depth] == '\0';
+    // While bounded the node is the cursor or a prefix of it, both sort before the page
+    if (node->server_index != -1 && !bounded) {
+        buffer[depth] = '\0';
+        state->visit(buffer, node->server_index, state->arg);
+        state->remaining--;
+    }
+    if (depth >= 1023) {
+        return;
+    }
+    // Everything below the cursor path itself sorts after it
+    int still_bounded = bounded && !at_cursor;
+    int first = still_bounded ? (unsigned char)state->after[depth] : 0;
+    for (int i = first; i < MAX_ASCII && state->remaining > 0; i++) {
+        if (node->children[i] != NULL) {
+            buffer[depth] = (char)i;
+            listTrieHelper(node->children[i], buffer, depth + 1, still_bounded && i == first, state);
+        }
+    }
+}
+
+// List one page of the subtree under prefix
+int listTrie(TrieNode* root, const char* prefix, const char* after, int limit, void (*visit)(const char* path, int server_index, void* arg), void* arg) {
+    char buffer[1024];
+    int prefix_len = strlen(prefix);
+    if (prefix_len >= (int)sizeof(buffer)) {
+        return 0;
+    }
+    TrieNode* node = prefix_len ? findTrieNode(root, prefix) : root;
+    if (node == NULL) {
+        return 0;
+    }
+    memcpy(buffer, prefix, prefix_len);
+
+    ListState state = {after ? after : "", limit, visit, arg};
+    // A cursor outside the prefix either precedes the whole subtree or follows it
+    int bounded = 0;
+    if (state.after[0] != '\0') {
+        int cmp = strncmp(state.after, prefix, prefix_len);
+        if (cmp > 0) {
+            return 0;
+        }
+        bounded = (cmp == 0);
+    }
+    listTrieHelper(node, buffer, prefix_len, bounded, &state);
+    return limit - state.remaining;
+}
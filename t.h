@@ -2,11 +2,24 @@
 #define TRIE_H
 
 #define MAX_ASCII 128  // Maximum number of ASCII characters
+#define MAX_REPLICAS 4 // Maximum number of storage servers holding a copy of one path
+
+// Cached metadata for a path, kept current by storage server notifications
+typedef struct {
+    long long size;   // Size in bytes
+    int mode;         // st_mode, type and permission bits
+    long long atime;  // Last access time
+    long long mtime;  // Last modification time
+    long long ctime;  // Last status change time
+} PathMeta;
 
 // TrieNode structure for the Trie data structure
 typedef struct TrieNode {
     struct TrieNode* children[MAX_ASCII];  // Array of pointers to children, one for each ASCII character
     int server_index;                      // Index of the storage server, -1 if none assigned
+    int replicas[MAX_REPLICAS];            // Replica chain for the path, replicas[0] == server_index (head)
+    int replica_count;                     // Number of valid entries in replicas
+    PathMeta* meta;                        // Cached metadata, NULL until a storage server reports it
 } TrieNode;
 
 // Function to create a new Trie node
@@ -26,4 +39,26 @@ void freeTrie(TrieNode* root);
 
 void deleteTrie(TrieNode* root, const char* path);
 
+// Function to append a storage server to the replica chain of an existing path, returns 1 if added
+int addTrieReplica(TrieNode* root, const char* path, int server_index);
+
+// Function to copy the replica chain of a path into out (head first), returning the number of replicas
+int getTrieReplicas(TrieNode* root, const char* path, int* out, int max);
+
+// Function to take a storage server out of a path's replica chain, promoting the next replica to head
+void removeTrieReplica(TrieNode* root, const char* path, int server_index);
+
+// Function to cache metadata for an existing path (NULL drops it), returns 1 if the path was found
+int setTrieMeta(TrieNode* root, const char* path, const PathMeta* meta);
+
+// Function to copy the cached metadata of a path into out, returns 0 on a miss
+int getTrieMeta(TrieNode* root, const char* path, PathMeta* out);
+
+// Function to visit, in lexicographic order, up to limit paths starting with prefix and sorting after the cursor
+// (NULL or "" for the first page); only the prefix's subtree is walked. Returns the number of paths visited
+int listTrie(TrieNode* root, const char* prefix, const char* after, int limit, void (*visit)(const char* path, int server_index, void* arg), void* arg);
+
+// Function to call visit for every path stored in the Trie
+void forEachTriePath(TrieNode* root, void (*visit)(const char* path, TrieNode* node, void* arg), void* arg);
+
 #endif // TRIE_H
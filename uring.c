@@ -0,0 +1,226 @@
+#include "uring.h"
+
+#ifdef USE_IO_URING
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int ringSetup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ringEnter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int ringRegister(int fd, unsigned opcode, void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Function to set up a ring of entries SQEs. With with_buffers it also registers URING_BUFFERS buffers of
+// URING_BUFFER_SIZE and a one-slot file table. Returns 0, or -1 with errno set (ENOSYS, EPERM when disabled)
+int uringInit(Uring *ring, unsigned entries, int with_buffers) {
+    memset(ring, 0, sizeof(Uring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = ringSetup(entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uringExit(ring);
+        return -1;
+    }
+
+    char *sq = (char*)ring->sq_ring;
+    char *cq = (char*)ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    if (with_buffers) {
+        struct iovec iov[URING_BUFFERS];
+        int file = -1;  // Empty slot, filled per transfer by uringSetFile
+        ring->buffers = (char*)aligned_alloc(4096, (size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+        for (int i = 0; ring->buffers && i < URING_BUFFERS; i++) {
+            iov[i].iov_base = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+            iov[i].iov_len = URING_BUFFER_SIZE;
+        }
+        if (!ring->buffers || ringRegister(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0 ||
+            ringRegister(ring->fd, IORING_REGISTER_FILES, &file, 1) < 0) {
+            int saved = ring->buffers ? errno : ENOMEM;
+            uringExit(ring);
+            errno = saved;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to tear a ring down; the kernel drops its registrations with the fd
+void uringExit(Uring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    free(ring->buffers);
+    ring->buffers = NULL;
+}
+
+// Function to get the next free SQE, zeroed, or NULL when the submission queue is full
+struct io_uring_sqe* uringGetSqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->queued;
+    if (tail - head >= ring->entries) {
+        return NULL;
+    }
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+// Function to hand the queued SQEs to the kernel with one io_uring_enter and wait for at least wait completions.
+// SQEs the kernel left in the queue on an earlier call are submitted again
+int uringSubmit(Uring *ring, unsigned wait) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+    ring->queued = 0;
+    unsigned submit = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int result = ringEnter(ring->fd, submit, wait, flags);
+    while (result < 0 && errno == EINTR) {
+        result = ringEnter(ring->fd, 0, wait, flags);  // Interrupted while waiting, the SQEs went in already
+    }
+    return result;
+}
+
+// Function to take back the newest SQE the kernel has not consumed, after a failed submit. Returns 1 if there was one
+int uringTakeBack(Uring *ring, struct io_uring_sqe *sqe) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->queued;
+    if (tail == head) {
+        return 0;
+    }
+    tail--;
+    *sqe = ring->sqes[ring->sq_array[tail & *ring->sq_mask]];
+    if (ring->queued > 0) {
+        ring->queued--;
+    } else {
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+// Function to take the oldest completion, returns 1 if there was one
+int uringPeekCqe(Uring *ring, struct io_uring_cqe *cqe) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Function to put fd in the ring's registered file slot 0, -1 empties it
+int uringSetFile(Uring *ring, int fd) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = 0;
+    update.fds = (unsigned long long)(unsigned long)&fd;
+    return ringRegister(ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0 ? -1 : 0;
+}
+
+// Function to create a pool of rings with registered buffers, NULL if io_uring is not available here
+UringPool* createUringPool(int rings) {
+    UringPool *pool = (UringPool*)calloc(1, sizeof(UringPool));
+    if (!pool) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    for (int i = 0; i < rings; i++) {
+        Uring *ring = (Uring*)malloc(sizeof(Uring));
+        if (!ring || uringInit(ring, URING_DEPTH, 1) < 0) {
+            perror("io_uring setup failed");
+            free(ring);
+            break;
+        }
+        ring->next_free = pool->free;
+        pool->free = ring;
+        pool->count++;
+    }
+    if (pool->count == 0) {
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Function to take a ring from the pool, waiting for one if all are busy
+Uring* uringBorrow(UringPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->free) {
+        pthread_cond_wait(&pool->available, &pool->lock);
+    }
+    Uring *ring = pool->free;
+    pool->free = ring->next_free;
+    pthread_mutex_unlock(&pool->lock);
+    return ring;
+}
+
+void uringReturn(UringPool *pool, Uring *ring) {
+    pthread_mutex_lock(&pool->lock);
+    ring->next_free = pool->free;
+    pool->free = ring;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+#endif // USE_IO_URING
@@ -0,0 +1,53 @@
+#ifndef URING_H
+#define URING_H
+
+// Minimal io_uring wrapper on the raw system calls, built only with -DUSE_IO_URING
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define URING_DEPTH 64                  // Submission queue entries per ring
+#define URING_BUFFERS 8                 // Registered buffers per pooled ring, the read-ahead of one transfer
+#define URING_BUFFER_SIZE (256 * 1024)
+#define URING_RINGS_DEFAULT 0           // Pooled rings for transfers; sendfile wins on page-cached files
+
+typedef struct Uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+    unsigned queued;                    // SQEs filled since the last submit
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    char *buffers;                      // URING_BUFFERS registered buffers, NULL if the ring has none
+    struct Uring *next_free;
+} Uring;
+
+// Pool of rings with registered buffers and one registered file slot, borrowed for a transfer at a time
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    Uring *free;
+    int count;
+} UringPool;
+
+// Function declarations
+int uringInit(Uring *ring, unsigned entries, int with_buffers);
+void uringExit(Uring *ring);
+struct io_uring_sqe* uringGetSqe(Uring *ring);
+int uringSubmit(Uring *ring, unsigned wait);
+int uringTakeBack(Uring *ring, struct io_uring_sqe *sqe);
+int uringPeekCqe(Uring *ring, struct io_uring_cqe *cqe);
+int uringSetFile(Uring *ring, int fd);
+UringPool* createUringPool(int rings);
+Uring* uringBorrow(UringPool *pool);
+void uringReturn(UringPool *pool, Uring *ring);
+
+#endif // USE_IO_URING
+
+#endif // URING_H